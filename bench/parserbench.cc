@@ -0,0 +1,163 @@
+#include <absl/strings/match.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <tidy/tidybuffio.h>
+#include <vector>
+
+#include "loginpagescanner.h"
+#include "outletpageparser.h"
+#include "tidyHelper.h"
+#include "tidydocwrapper.h"
+
+// Counts operator new only; tidy and libc allocate with malloc.
+static size_t allocations = 0;
+
+void* operator new(size_t size) {
+  allocations++;
+  if (void* p = std::malloc(size == 0 ? 1 : size)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+  std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  std::free(p);
+}
+
+// Runs op until minimum has passed and reports ns/op and allocations/op.
+static void measure(const std::string& page, absl::string_view label,
+                    const std::function<bool()>& op) {
+  static const auto minimum = std::chrono::milliseconds(200);
+  if (op() == false) {
+    std::cout << page << "  " << label << "  FAILED" << std::endl;
+    return;
+  }
+  size_t iterations = 0;
+  auto allocationsBefore = allocations;
+  auto start = std::chrono::steady_clock::now();
+  std::chrono::steady_clock::duration elapsed;
+  do {
+    for (int i = 0; i < 16; i++) {
+      op();
+    }
+    iterations += 16;
+    elapsed = std::chrono::steady_clock::now() - start;
+  } while (elapsed < minimum);
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+  char line[160];
+  snprintf(line, sizeof(line), "%-24s %-28s %12.0f ns/op %8.1f allocs/op",
+           page.c_str(), std::string(label).c_str(),
+           static_cast<double>(ns) / iterations,
+           static_cast<double>(allocations - allocationsBefore) / iterations);
+  std::cout << line << std::endl;
+}
+
+// Mirrors the tidy fallback of WebPowerSwitch::parseLoginPage.
+static bool tidyLoginPage(const std::string& page) {
+  TidyDocWrapper tdw;
+  TidyBuffer errbuf = {};
+  tidySetErrorBuffer(tdw, &errbuf);
+  tidyOptSetInt(tdw, TidyUseCustomTags, TidyCustomBlocklevel);
+  auto result = tidyParseString(tdw, page.c_str());
+  tidyBufFree(&errbuf);
+  if (result > 1) {
+    return false;
+  }
+  tidyHelper::NodeIndex index(tdw);
+  auto input = index.findNodeByAttr("input", TidyAttr_NAME, "challenge", nullptr);
+  auto form = index.findNodeByAttr("form", TidyAttr_NAME, "login", nullptr);
+  return input != nullptr && tidyAttrGetById(input, TidyAttr_VALUE) != nullptr &&
+      form != nullptr && tidyAttrGetById(form, TidyAttr_ACTION) != nullptr;
+}
+
+static bool parseOutletPage(OutletPageParser& parser, absl::string_view page, size_t chunk) {
+  parser.reset();
+  for (size_t offset = 0; offset < page.size(); offset += chunk) {
+    parser.feed(page.substr(offset, chunk));
+  }
+  return parser.finish() && !parser.outlets().empty();
+}
+
+int main(int iArgc, char* szArgv[]) {
+  std::filesystem::path corpus = iArgc > 1 ? szArgv[1] : "synthetic";
+  std::vector<std::filesystem::path> files;
+  for (const auto& entry : std::filesystem::directory_iterator(corpus)) {
+    if (entry.path().extension() == ".htm") {
+      files.push_back(entry.path());
+    }
+  }
+  if (files.empty()) {
+    std::cerr << "no pages in corpus: " << corpus << std::endl;
+    return 1;
+  }
+  std::sort(files.begin(), files.end());
+
+  bool failed = false;
+  for (const auto& file : files) {
+    std::ifstream in(file);
+    std::stringstream contents;
+    contents << in.rdbuf();
+    auto page = contents.str();
+    auto name = file.filename().string();
+
+    if (absl::StartsWith(name, "login")) {
+      absl::string_view challenge;
+      absl::string_view action;
+      if (!loginPageScanner::scan(page, challenge, action) || !tidyLoginPage(page)) {
+        failed = true;
+      }
+      measure(name, "challenge (scanner)", [&] {
+        return loginPageScanner::scan(page, challenge, action);
+      });
+      measure(name, "challenge (tidy)", [&] {
+        return tidyLoginPage(page);
+      });
+    } else if (absl::StartsWith(name, "index")) {
+      OutletPageParser parser;
+      if (!parseOutletPage(parser, page, page.size())) {
+        failed = true;
+      }
+      std::cout << name << "  controller: " << parser.name()
+                << "  outlets: " << parser.outlets().size() << std::endl;
+      // both paths must read the page the same way
+      OutletPageParser tidyParser;
+      if (!tidyParser.parseWithTidy(page) || tidyParser.name() != parser.name() ||
+          tidyParser.outlets().size() != parser.outlets().size()) {
+        std::cout << name << "  tidy read controller: " << tidyParser.name()
+                  << "  outlets: " << tidyParser.outlets().size() << std::endl;
+        failed = true;
+      }
+      // controller name alone: the page up to the outlet table
+      auto head = absl::string_view(page).substr(0, page.find("Individual Control"));
+      measure(name, "controller name", [&] {
+        parser.reset();
+        parser.feed(head);
+        return parser.finish();
+      });
+      measure(name, "outlets (one chunk)", [&] {
+        return parseOutletPage(parser, page, page.size());
+      });
+      measure(name, "outlets (1460 byte chunks)", [&] {
+        return parseOutletPage(parser, page, 1460);
+      });
+      // the fallback, and what every page went through before streaming
+      measure(name, "outlets (tidy)", [&] {
+        return parser.parseWithTidy(page) && !parser.outlets().empty();
+      });
+    }
+  }
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,46 @@
+#include "connectionpool.h"
+
+
+const size_t ConnectionPool::MAX_IDLE_HANDLES = 64;
+
+ConnectionPool::ConnectionPool()
+: share_(curl_share_init()) {
+  curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+  curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_COOKIE);
+  curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+}
+
+ConnectionPool::~ConnectionPool() {
+  for (auto handle : idle_) {
+    curl_easy_cleanup(handle);
+  }
+  idle_.clear();
+  curl_share_cleanup(share_);
+}
+
+CURL* ConnectionPool::acquire() {
+  CURL* handle;
+  if (idle_.empty()) {
+    handle = curl_easy_init();
+  } else {
+    handle = idle_.back();
+    idle_.pop_back();
+  }
+  curl_easy_setopt(handle, CURLOPT_SHARE, share_);
+  curl_easy_setopt(handle, CURLOPT_TCP_KEEPALIVE, 1L);
+  return handle;
+}
+
+void ConnectionPool::release(CURL* handle) {
+  if (handle == nullptr) {
+    return;
+  }
+  if (idle_.size() >= MAX_IDLE_HANDLES) {
+    curl_easy_cleanup(handle);
+    return;
+  }
+  // Options go back to defaults; connections stay in the share's cache.
+  curl_easy_reset(handle);
+  idle_.push_back(handle);
+}
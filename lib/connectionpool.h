@@ -0,0 +1,30 @@
+#ifndef __CONNECTIONPOOL_H__INCLUDED__
+#define __CONNECTIONPOOL_H__INCLUDED__
+
+#include <curl/curl.h>
+#include <vector>
+
+
+// Easy handles and a curl share (connections, DNS, cookies, TLS sessions)
+// reused across requests and switches, so follow-up requests ride an
+// already open keep-alive connection instead of a new handshake.
+// Not thread safe: use from the thread driving the requests.
+class ConnectionPool {
+public:
+  ConnectionPool();
+  ConnectionPool(const ConnectionPool&) = delete;
+  ~ConnectionPool();
+  // A reset handle already attached to the share.
+  CURL* acquire();
+  void release(CURL* handle);
+  CURLSH* share() const {
+    return share_;
+  }
+
+private:
+  static const size_t MAX_IDLE_HANDLES;
+  CURLSH* share_ = nullptr;
+  std::vector<CURL*> idle_;
+};
+
+#endif  /*  __CONNECTIONPOOL_H__INCLUDED__  */
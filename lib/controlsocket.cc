@@ -0,0 +1,278 @@
+#include "controlsocket.h"
+
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <poll.h>
+#include <sstream>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace controlSocket {
+
+namespace {
+
+const size_t MAX_REQUEST = 64 * 1024;
+const char* KEY_TARGET = "target";
+const char* KEY_COMMAND = "command";
+const char* KEY_MAXAGE = "max-age";
+const char* KEY_VERIFY = "verify";
+const char* KEY_STATUS = "status";
+
+volatile sig_atomic_t stopping = 0;
+
+void stop(int) {
+  stopping = 1;
+}
+
+bool address(absl::string_view path, struct sockaddr_un& addr) {
+  addr = {};
+  addr.sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+    return false;
+  }
+  memcpy(addr.sun_path, path.data(), path.size());
+  return true;
+}
+
+// The path may be in a shared directory (/tmp): whoever is at the other
+// end has to be this user.
+bool sameUser(int fd) {
+  struct ucred peer;
+  socklen_t length = sizeof(peer);
+  return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &length) == 0 && peer.uid == getuid();
+}
+
+int connectTo(absl::string_view path) {
+  struct sockaddr_un addr;
+  if (address(path, addr) == false) {
+    return -1;
+  }
+  auto fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool writeAll(int fd, absl::string_view data) {
+  while (!data.empty()) {
+    auto written = write(fd, data.data(), data.size());
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return false;
+    }
+    data.remove_prefix(written);
+  }
+  return true;
+}
+
+// Reads until the end of the connection, or until stop is found.
+bool readAll(int fd, std::string& data, absl::string_view stop = {}) {
+  char buffer[4096];
+  while (data.size() < MAX_REQUEST || stop.empty()) {
+    auto count = read(fd, buffer, sizeof(buffer));
+    if (count < 0 && errno == EINTR) {
+      continue;
+    }
+    if (count < 0) {
+      return false;
+    }
+    if (count == 0) {
+      return true;
+    }
+    data.append(buffer, count);
+    if (!stop.empty() && absl::string_view(data).find(stop) != absl::string_view::npos) {
+      return true;
+    }
+  }
+  return false;
+}
+
+std::string encode(const Request& request) {
+  return absl::StrCat(KEY_TARGET, " ", request.target, "\n",
+                      KEY_COMMAND, " ", request.command, "\n",
+                      KEY_MAXAGE, " ", request.maxAge, "\n",
+                      KEY_VERIFY, " ", request.verify ? 1 : 0, "\n\n");
+}
+
+bool decode(absl::string_view text, Request& request) {
+  for (absl::string_view line : absl::StrSplit(text, '\n')) {
+    if (line.empty()) {
+      break;
+    }
+    std::pair<absl::string_view, absl::string_view> field =
+        absl::StrSplit(line, absl::MaxSplits(' ', 1));
+    if (field.first == KEY_TARGET) {
+      request.target = std::string(field.second);
+    } else if (field.first == KEY_COMMAND) {
+      request.command = std::string(field.second);
+    } else if (field.first == KEY_MAXAGE) {
+      if (!absl::SimpleAtoi(field.second, &request.maxAge)) {
+        return false;
+      }
+    } else if (field.first == KEY_VERIFY) {
+      request.verify = field.second == "1";
+    } else {
+      return false;
+    }
+  }
+  return !request.target.empty();
+}
+
+void answer(int fd, const Handler& handler, int verbose) {
+  // a stalled client must not hold up the others for long
+  struct timeval timeout = {5, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  std::string text;
+  Request request;
+  if (readAll(fd, text, "\n\n") == false || decode(text, request) == false) {
+    writeAll(fd, absl::StrCat(KEY_STATUS, " -1\nERROR: malformed request\n"));
+    return;
+  }
+  if (verbose) {
+    std::cout << "request: " << request.target << " " << request.command << std::endl;
+  }
+  std::ostringstream out;
+  auto status = handler(request, out);
+  writeAll(fd, absl::StrCat(KEY_STATUS, " ", status, "\n", out.str()));
+}
+
+}  // namespace
+
+std::string defaultPath() {
+  const char* directory = getenv("XDG_RUNTIME_DIR");
+  if (directory == nullptr) {
+    directory = getenv("TMPDIR");
+  }
+  if (directory == nullptr) {
+    directory = "/tmp";
+  }
+  return absl::StrCat(directory, "/pwrcntrl-", getuid(), ".sock");
+}
+
+bool call(absl::string_view path, const Request& request, std::ostream& out, int& status) {
+  auto fd = connectTo(path);
+  if (fd < 0) {
+    return false;
+  }
+  if (sameUser(fd) == false) {
+    std::cerr << "WARNING: ignoring server of another user at: " << path << std::endl;
+    close(fd);
+    return false;
+  }
+  std::string response;
+  bool sent = writeAll(fd, encode(request)) && shutdown(fd, SHUT_WR) == 0;
+  bool received = sent && readAll(fd, response);
+  close(fd);
+
+  // "status <n>\n" then the output
+  auto newline = response.find('\n');
+  std::pair<absl::string_view, absl::string_view> field =
+      absl::StrSplit(absl::string_view(response).substr(0, newline), absl::MaxSplits(' ', 1));
+  if (!received || newline == std::string::npos || field.first != KEY_STATUS ||
+      !absl::SimpleAtoi(field.second, &status)) {
+    std::cerr << "ERROR: no answer from: " << path << std::endl;
+    status = -1;
+    return true;
+  }
+  out << absl::string_view(response).substr(newline + 1) << std::flush;
+  return true;
+}
+
+bool serve(absl::string_view path, const Handler& handler, const Idle& idle, int verbose) {
+  auto running = connectTo(path);
+  if (running >= 0) {
+    close(running);
+    std::cerr << "ERROR: already being served: " << path << std::endl;
+    return false;
+  }
+  struct sockaddr_un addr;
+  if (address(path, addr) == false) {
+    std::cerr << "ERROR: invalid socket path: " << path << std::endl;
+    return false;
+  }
+  // Left behind by a server that did not shut down, and removed; unless it
+  // is someone else's (or not a socket at all).
+  struct stat statPath;
+  if (lstat(addr.sun_path, &statPath) == 0) {
+    if (!S_ISSOCK(statPath.st_mode) || statPath.st_uid != getuid()) {
+      std::cerr << "ERROR: not a socket of this user: " << path << std::endl;
+      return false;
+    }
+    unlink(addr.sun_path);
+  }
+
+  auto fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  // created owner only: a connection can switch power
+  auto mask = umask(077);
+  bool bound = fd >= 0 && bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == 0;
+  umask(mask);
+  if (!bound || listen(fd, 16) != 0) {
+    std::cerr << "ERROR: failed to listen on: " << path << " ("
+              << errno << ": " << strerror(errno) << ")" << std::endl;
+    if (fd >= 0) {
+      close(fd);
+    }
+    return false;
+  }
+
+  // no SA_RESTART: a signal has to interrupt accept()
+  struct sigaction action = {};
+  action.sa_handler = stop;
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+  signal(SIGPIPE, SIG_IGN);
+  stopping = 0;
+
+  if (verbose) {
+    std::cout << "serving: " << path << std::endl;
+  }
+  while (!stopping) {
+    auto timeout = idle ? idle() : -1;
+    if (stopping) {
+      break;
+    }
+    struct pollfd listening = {fd, POLLIN, 0};
+    auto ready = poll(&listening, 1, timeout);
+    if (ready <= 0) {
+      if (ready < 0 && errno != EINTR) {
+        std::cerr << "ERROR: poll failed: " << errno << ": " << strerror(errno) << std::endl;
+        break;
+      }
+      continue;
+    }
+    auto client = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (client < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      std::cerr << "ERROR: accept failed: " << errno << ": " << strerror(errno) << std::endl;
+      break;
+    }
+    if (sameUser(client)) {
+      answer(client, handler, verbose);
+    } else if (verbose) {
+      std::cout << "refused a client of another user" << std::endl;
+    }
+    close(client);
+  }
+
+  close(fd);
+  unlink(addr.sun_path);
+  return true;
+}
+
+}
@@ -0,0 +1,43 @@
+#ifndef __CONTROLSOCKET_H__INCLUDED__
+#define __CONTROLSOCKET_H__INCLUDED__
+
+#include <absl/strings/string_view.h>
+#include <ctime>
+#include <functional>
+#include <ostream>
+#include <string>
+
+
+// Commands to a long running process over a Unix domain socket.  A request
+// is "key value" lines up to an empty line; the answer is "status <n>" and
+// then the command's output, up to the end of the connection.
+namespace controlSocket {
+
+struct Request {
+  // switch name, host or outlet name; or "all"
+  std::string target;
+  std::string command;
+  time_t maxAge = 0;
+  bool verify = false;
+};
+
+// Returns the exit status of the command; output goes to out.
+using Handler = std::function<int(const Request& request, std::ostream& out)>;
+// Between requests: does whatever is due, and returns how long (ms) to wait
+// for a request before it is called again; -1 for as long as it takes.
+using Idle = std::function<int()>;
+
+// Private to the user: $XDG_RUNTIME_DIR (or $TMPDIR) /pwrcntrl-<uid>.sock
+std::string defaultPath();
+// false if nothing (of this user) is listening at path; otherwise status is
+// the command's.
+bool call(absl::string_view path, const Request& request, std::ostream& out, int& status);
+// One request at a time, from this user only, until SIGINT or SIGTERM;
+// false if path is taken by a running server or by another user, or cannot
+// be bound.
+bool serve(absl::string_view path, const Handler& handler, const Idle& idle = nullptr,
+           int verbose = 0);
+
+}
+
+#endif  /*  __CONTROLSOCKET_H__INCLUDED__  */
@@ -0,0 +1,90 @@
+#include "eventloop.h"
+
+#include <iostream>
+
+
+bool EventLoop::Transfer::await_suspend(std::coroutine_handle<> waiting) {
+  if (loop_.broken_ || curl_multi_add_handle(loop_.multi_, handle_) != CURLM_OK) {
+    // not suspended: the transfer fails right away
+    result_ = CURLE_FAILED_INIT;
+    return false;
+  }
+  waiting_ = waiting;
+  loop_.inFlight_[handle_] = this;
+  return true;
+}
+
+EventLoop::EventLoop()
+: multi_(curl_multi_init()) {
+}
+
+EventLoop::~EventLoop() {
+  for (auto& [handle, transfer] : inFlight_) {
+    curl_multi_remove_handle(multi_, handle);
+  }
+  inFlight_.clear();
+  curl_multi_cleanup(multi_);
+}
+
+void EventLoop::run() {
+  while (!ready_.empty() || !inFlight_.empty()) {
+    // Resumed coroutines may start transfers (or finish) before the next wait.
+    while (!ready_.empty()) {
+      auto coroutine = ready_.front();
+      ready_.pop_front();
+      coroutine.resume();
+    }
+    if (inFlight_.empty()) {
+      break;
+    }
+
+    int running = 0;
+    CURLMcode mc = curl_multi_perform(multi_, &running);
+    if (mc != CURLM_OK) {
+      std::cerr << "curl_multi_perform failed: " << curl_multi_strerror(mc) << std::endl;
+      failAll();
+      continue;
+    }
+
+    CURLMsg* msg;
+    int msgsLeft;
+    while ((msg = curl_multi_info_read(multi_, &msgsLeft))) {
+      if (msg->msg == CURLMSG_DONE) {
+        finish(msg->easy_handle, msg->data.result);
+      }
+    }
+
+    if (ready_.empty() && running > 0) {
+      // Block only until a socket is ready or curl's next internal timer.
+      long timeout = -1;
+      curl_multi_timeout(multi_, &timeout);
+      if (timeout < 0 || timeout > 1000) {
+        timeout = 1000;
+      }
+      mc = curl_multi_poll(multi_, nullptr, 0, static_cast<int>(timeout), nullptr);
+      if (mc != CURLM_OK) {
+        std::cerr << "curl_multi_poll failed: " << curl_multi_strerror(mc) << std::endl;
+        failAll();
+      }
+    }
+  }
+}
+
+void EventLoop::finish(CURL* handle, CURLcode result) {
+  auto found = inFlight_.find(handle);
+  if (found == inFlight_.end()) {
+    return;
+  }
+  auto transfer = found->second;
+  inFlight_.erase(found);
+  curl_multi_remove_handle(multi_, handle);
+  transfer->result_ = result;
+  ready_.push_back(transfer->waiting_);
+}
+
+void EventLoop::failAll() {
+  broken_ = true;
+  while (!inFlight_.empty()) {
+    finish(inFlight_.begin()->first, CURLE_FAILED_INIT);
+  }
+}
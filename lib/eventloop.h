@@ -0,0 +1,69 @@
+#ifndef __EVENTLOOP_H__INCLUDED__
+#define __EVENTLOOP_H__INCLUDED__
+
+#include <coroutine>
+#include <curl/curl.h>
+#include <deque>
+#include <unordered_map>
+
+#include "task.h"
+
+
+// One curl multi handle shared by any number of coroutines: each awaits
+// perform(handle) and is resumed, from run(), when that transfer finishes.
+// Tasks (and the handles they perform) must outlive run().
+class EventLoop {
+public:
+  class Transfer {
+  public:
+    bool await_ready() const noexcept {
+      return false;
+    }
+    bool await_suspend(std::coroutine_handle<> waiting);
+    CURLcode await_resume() const noexcept {
+      return result_;
+    }
+
+  private:
+    friend class EventLoop;
+    Transfer(EventLoop& loop, CURL* handle)
+    : loop_(loop), handle_(handle) {}
+
+    EventLoop& loop_;
+    CURL* handle_;
+    std::coroutine_handle<> waiting_;
+    CURLcode result_ = CURLE_OK;
+  };
+
+  EventLoop();
+  EventLoop(const EventLoop&) = delete;
+  ~EventLoop();
+  // co_await perform(handle) yields the CURLcode of the transfer.
+  Transfer perform(CURL* handle) {
+    return Transfer(*this, handle);
+  }
+  template <typename T>
+  void start(Task<T>& task) {
+    ready_.push_back(task.handle());
+  }
+  // Until every started task is finished.
+  void run();
+  template <typename T>
+  T wait(Task<T> task) {
+    start(task);
+    run();
+    return task.result();
+  }
+
+private:
+  CURLM* multi_ = nullptr;
+  std::unordered_map<CURL*, Transfer*> inFlight_;
+  std::deque<std::coroutine_handle<>> ready_;
+  // after a multi error every transfer fails at once
+  bool broken_ = false;
+
+  void finish(CURL* handle, CURLcode result);
+  void failAll();
+};
+
+#endif  /*  __EVENTLOOP_H__INCLUDED__  */
@@ -0,0 +1,129 @@
+#include "loginpagescanner.h"
+
+#include <absl/strings/match.h>
+
+namespace loginPageScanner {
+
+namespace {
+
+bool isSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\f';
+}
+
+bool isNameChar(char c) {
+  return !isSpace(c) && c != '=' && c != '>' && c != '/' && c != '<';
+}
+
+// Reads one attribute starting at pos; false at the end of the tag.
+bool nextAttribute(absl::string_view page, size_t& pos,
+                   absl::string_view& name, absl::string_view& value) {
+  while (pos < page.size() && (isSpace(page[pos]) || page[pos] == '/')) {
+    pos++;
+  }
+  if (pos >= page.size() || page[pos] == '>') {
+    return false;
+  }
+  auto start = pos;
+  while (pos < page.size() && isNameChar(page[pos])) {
+    pos++;
+  }
+  name = page.substr(start, pos - start);
+  value = {};
+  while (pos < page.size() && isSpace(page[pos])) {
+    pos++;
+  }
+  if (pos >= page.size() || page[pos] != '=') {
+    // valueless attribute; make sure a stray character cannot stall us
+    if (name.empty()) {
+      pos++;
+    }
+    return true;
+  }
+  pos++;
+  while (pos < page.size() && isSpace(page[pos])) {
+    pos++;
+  }
+  if (pos < page.size() && (page[pos] == '"' || page[pos] == '\'')) {
+    auto quote = page[pos++];
+    auto end = page.find(quote, pos);
+    if (end == absl::string_view::npos) {
+      end = page.size();
+    }
+    value = page.substr(pos, end - pos);
+    pos = end + 1;
+  } else {
+    start = pos;
+    while (pos < page.size() && !isSpace(page[pos]) && page[pos] != '>') {
+      pos++;
+    }
+    value = page.substr(start, pos - start);
+  }
+  return true;
+}
+
+}  // namespace
+
+bool scan(absl::string_view page, absl::string_view& challenge,
+          absl::string_view& action) {
+  bool haveChallenge = false;
+  bool haveAction = false;
+  size_t pos = 0;
+  while (!(haveChallenge && haveAction)) {
+    pos = page.find('<', pos);
+    if (pos == absl::string_view::npos) {
+      break;
+    }
+    pos++;
+    if (page.substr(pos, 3) == "!--") {
+      pos = page.find("-->", pos + 3);
+      continue;
+    }
+    auto start = pos;
+    while (pos < page.size() && isNameChar(page[pos])) {
+      pos++;
+    }
+    auto tag = page.substr(start, pos - start);
+    bool isInput = absl::EqualsIgnoreCase(tag, "input");
+    bool isForm = absl::EqualsIgnoreCase(tag, "form");
+    if (absl::EqualsIgnoreCase(tag, "script") || absl::EqualsIgnoreCase(tag, "style")) {
+      // raw text: a "<input" inside a script string is not markup
+      while ((pos = page.find("</", pos)) != absl::string_view::npos &&
+             !absl::EqualsIgnoreCase(page.substr(pos + 2, tag.size()), tag)) {
+        pos += 2;
+      }
+      continue;
+    }
+    if (!isInput && !isForm) {
+      continue;
+    }
+
+    absl::string_view name;
+    absl::string_view value;
+    absl::string_view nameValue;
+    absl::string_view wanted;
+    bool named = false;
+    bool haveWanted = false;
+    while (nextAttribute(page, pos, name, value)) {
+      if (absl::EqualsIgnoreCase(name, "name")) {
+        nameValue = value;
+        named = true;
+      } else if (absl::EqualsIgnoreCase(name, isInput ? "value" : "action")) {
+        wanted = value;
+        haveWanted = true;
+      }
+    }
+    if (!named || !haveWanted) {
+      continue;
+    }
+    if (isInput && !haveChallenge && absl::EqualsIgnoreCase(nameValue, "challenge")) {
+      challenge = wanted;
+      haveChallenge = true;
+    } else if (isForm && !haveAction && absl::EqualsIgnoreCase(nameValue, "login")) {
+      action = wanted;
+      haveAction = true;
+    }
+  }
+  return haveChallenge && haveAction;
+}
+
+}
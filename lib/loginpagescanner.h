@@ -0,0 +1,16 @@
+#ifndef __LOGINPAGESCANNER_H__INCLUDED__
+#define __LOGINPAGESCANNER_H__INCLUDED__
+
+#include <absl/strings/string_view.h>
+
+namespace loginPageScanner {
+
+// Single pass over the raw login page for the value of the "challenge"
+// input and the action of the "login" form, without building a DOM.
+// Both views point into page.  Returns false unless both were found.
+bool scan(absl::string_view page, absl::string_view& challenge,
+          absl::string_view& action);
+
+}
+
+#endif  /*  __LOGINPAGESCANNER_H__INCLUDED__  */
@@ -1,28 +1,177 @@
 #include "md5Helper.h"
 
+#include <algorithm>
+#include <cstdint>
+#include <memory>
 #include <openssl/evp.h>
 
 namespace md5Helper {
 
-std::vector<unsigned char> calculate(const unsigned char* buf, unsigned int buf_size) {
-    EVP_MD_CTX *mdctx;
-    unsigned char *md5_digest;
-    unsigned int md5_digest_len = EVP_MD_size(EVP_md5());
+namespace {
+
+struct ContextDeleter {
+  void operator()(EVP_MD_CTX* context) const {
+    EVP_MD_CTX_free(context);
+  }
+};
+
+EVP_MD_CTX* threadContext() {
+  thread_local std::unique_ptr<EVP_MD_CTX, ContextDeleter> context(EVP_MD_CTX_new());
+  return context.get();
+}
+
+// Four independent MD5 states, one message per lane (RFC 1321).
+constexpr size_t LANES = 4;
+typedef uint32_t Lanes __attribute__((vector_size(LANES * sizeof(uint32_t))));
+
+const uint32_t K[64] = {
+  0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+  0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+  0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+  0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+  0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+  0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+  0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+  0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+const int S[64] = {
+  7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+  5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+  4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+  6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+};
+
+// Message plus 0x80, zeros and the bit length, in whole 64 byte blocks.
+std::string pad(const std::string& message) {
+  std::string padded = message;
+  padded += '\x80';
+  padded.append((119 - message.size() % 64) % 64, '\0');
+  uint64_t bits = static_cast<uint64_t>(message.size()) * 8;
+  for (int i = 0; i < 8; i++) {
+    padded += static_cast<char>(bits >> (8 * i));
+  }
+  return padded;
+}
+
+uint32_t loadWord(const std::string& padded, size_t offset) {
+  auto p = reinterpret_cast<const unsigned char*>(padded.data()) + offset;
+  return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
 
-    // MD5_Init
-    mdctx = EVP_MD_CTX_new();
-    EVP_DigestInit_ex(mdctx, EVP_md5(), NULL);
+void hashLanes(const std::string* padded[LANES], Digest* out[LANES]) {
+  Lanes state[4] = {
+    {0x67452301, 0x67452301, 0x67452301, 0x67452301},
+    {0xefcdab89, 0xefcdab89, 0xefcdab89, 0xefcdab89},
+    {0x98badcfe, 0x98badcfe, 0x98badcfe, 0x98badcfe},
+    {0x10325476, 0x10325476, 0x10325476, 0x10325476},
+  };
+  size_t blocks = 0;
+  for (size_t lane = 0; lane < LANES; lane++) {
+    if (padded[lane] != nullptr) {
+      blocks = std::max(blocks, padded[lane]->size() / 64);
+    }
+  }
 
-    // MD5_Update
-    EVP_DigestUpdate(mdctx, buf, buf_size);
+  for (size_t block = 0; block < blocks; block++) {
+    Lanes m[16] = {};
+    Lanes active = {};
+    for (size_t lane = 0; lane < LANES; lane++) {
+      if (padded[lane] == nullptr || padded[lane]->size() / 64 <= block) {
+        continue;
+      }
+      active[lane] = ~0u;
+      for (size_t word = 0; word < 16; word++) {
+        m[word][lane] = loadWord(*padded[lane], block * 64 + word * 4);
+      }
+    }
 
-    // MD5_Final
-    md5_digest = (unsigned char *)OPENSSL_malloc(md5_digest_len);
-    EVP_DigestFinal_ex(mdctx, md5_digest, &md5_digest_len);
-    std::vector<unsigned char> result(md5_digest, &md5_digest[md5_digest_len]);
-    EVP_MD_CTX_free(mdctx);
+    auto a = state[0];
+    auto b = state[1];
+    auto c = state[2];
+    auto d = state[3];
+    for (int i = 0; i < 64; i++) {
+      Lanes f;
+      int g;
+      if (i < 16) {
+        f = (b & c) | (~b & d);
+        g = i;
+      } else if (i < 32) {
+        f = (d & b) | (~d & c);
+        g = (5 * i + 1) % 16;
+      } else if (i < 48) {
+        f = b ^ c ^ d;
+        g = (3 * i + 5) % 16;
+      } else {
+        f = c ^ (b | ~d);
+        g = (7 * i) % 16;
+      }
+      f = f + a + K[i] + m[g];
+      a = d;
+      d = c;
+      c = b;
+      b = b + ((f << S[i]) | (f >> (32 - S[i])));
+    }
+    // lanes whose message has ended keep their state
+    state[0] += a & active;
+    state[1] += b & active;
+    state[2] += c & active;
+    state[3] += d & active;
+  }
+
+  for (size_t lane = 0; lane < LANES; lane++) {
+    if (out[lane] == nullptr) {
+      continue;
+    }
+    for (size_t word = 0; word < 4; word++) {
+      for (size_t byte = 0; byte < 4; byte++) {
+        (*out[lane])[word * 4 + byte] = static_cast<unsigned char>(state[word][lane] >> (8 * byte));
+      }
+    }
+  }
+}
+
+}  // namespace
+
+std::vector<unsigned char> calculate(const unsigned char* buf, unsigned int buf_size) {
+  auto result = digest(absl::string_view(reinterpret_cast<const char*>(buf), buf_size));
+  return std::vector<unsigned char>(result.begin(), result.end());
+}
+
+Digest digest(absl::string_view buf) {
+  Digest result = {};
+  auto mdctx = threadContext();
+  unsigned int md5_digest_len = result.size();
+  EVP_DigestInit_ex(mdctx, EVP_md5(), NULL);
+  EVP_DigestUpdate(mdctx, buf.data(), buf.size());
+  EVP_DigestFinal_ex(mdctx, result.data(), &md5_digest_len);
+  return result;
+}
+
+std::vector<Digest> digests(const std::vector<std::string>& bufs) {
+  std::vector<Digest> result(bufs.size());
+  std::string padded[LANES];
+  for (size_t first = 0; first < bufs.size(); first += LANES) {
+    const std::string* lanes[LANES] = {};
+    Digest* out[LANES] = {};
+    for (size_t lane = 0; lane < LANES && first + lane < bufs.size(); lane++) {
+      padded[lane] = pad(bufs[first + lane]);
+      lanes[lane] = &padded[lane];
+      out[lane] = &result[first + lane];
+    }
+    hashLanes(lanes, out);
+  }
+  return result;
+}
 
-    return result;
+std::string toHex(const Digest& digest) {
+  static const char HEX[] = "0123456789abcdef";
+  std::string result(digest.size() * 2, '\0');
+  for (size_t i = 0; i < digest.size(); i++) {
+    result[2 * i] = HEX[digest[i] >> 4];
+    result[2 * i + 1] = HEX[digest[i] & 0x0f];
+  }
+  return result;
 }
 
 }
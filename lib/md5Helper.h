@@ -1,11 +1,22 @@
 #ifndef __MD5HELPER_H__INCLUDED__
 #define __MD5HELPER_H__INCLUDED__
 
+#include <absl/strings/string_view.h>
+#include <array>
+#include <string>
 #include <vector>
 
 namespace md5Helper {
 
+using Digest = std::array<unsigned char, 16>;
+
 std::vector<unsigned char> calculate(const unsigned char* buf, unsigned int buf_size);
+// Uses an MD5 context kept per thread; nothing is allocated.
+Digest digest(absl::string_view buf);
+// Digests of all of bufs, hashed four at a time in vector lanes.
+std::vector<Digest> digests(const std::vector<std::string>& bufs);
+// Lower case, two characters per byte.
+std::string toHex(const Digest& digest);
 
 }
 
@@ -0,0 +1,442 @@
+#include "outletpageparser.h"
+
+#include <absl/strings/ascii.h>
+#include <absl/strings/match.h>
+#include <absl/strings/str_cat.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <tidy/tidybuffio.h>
+
+#include "tidyHelper.h"
+#include "tidydocwrapper.h"
+
+const size_t OutletPageParser::MAX_CELL_TEXT = 1024;
+
+namespace {
+
+const absl::string_view NBSP = "\xC2\xA0";
+
+void appendUtf8(std::string& out, uint32_t codePoint) {
+  if (codePoint < 0x80) {
+    out += static_cast<char>(codePoint);
+  } else if (codePoint < 0x800) {
+    out += static_cast<char>(0xC0 | (codePoint >> 6));
+    out += static_cast<char>(0x80 | (codePoint & 0x3F));
+  } else if (codePoint < 0x10000) {
+    out += static_cast<char>(0xE0 | (codePoint >> 12));
+    out += static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F));
+    out += static_cast<char>(0x80 | (codePoint & 0x3F));
+  } else {
+    out += static_cast<char>(0xF0 | (codePoint >> 18));
+    out += static_cast<char>(0x80 | ((codePoint >> 12) & 0x3F));
+    out += static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F));
+    out += static_cast<char>(0x80 | (codePoint & 0x3F));
+  }
+}
+
+// The entities the switches use; anything else is left as written.
+bool decodeEntity(absl::string_view entity, std::string& out) {
+  if (absl::StartsWith(entity, "#")) {
+    entity.remove_prefix(1);
+    int base = 10;
+    if (absl::StartsWithIgnoreCase(entity, "x")) {
+      entity.remove_prefix(1);
+      base = 16;
+    }
+    if (entity.empty() || entity.size() > 8) {
+      return false;
+    }
+    uint32_t codePoint = 0;
+    for (auto c : entity) {
+      int digit = absl::ascii_isdigit(c) ? c - '0'
+          : base == 16 && absl::ascii_isxdigit(c) ? absl::ascii_tolower(c) - 'a' + 10
+          : -1;
+      if (digit < 0) {
+        return false;
+      }
+      codePoint = codePoint * base + digit;
+    }
+    if (codePoint == 0 || codePoint > 0x10FFFF ||
+        (codePoint >= 0xD800 && codePoint <= 0xDFFF)) {
+      return false;
+    }
+    appendUtf8(out, codePoint);
+    return true;
+  }
+  static const std::pair<absl::string_view, absl::string_view> named[] = {
+    {"amp", "&"}, {"lt", "<"}, {"gt", ">"}, {"quot", "\""}, {"apos", "'"},
+    {"nbsp", NBSP},
+  };
+  for (const auto& [name, text] : named) {
+    if (entity == name) {
+      out.append(text.data(), text.size());
+      return true;
+    }
+  }
+  return false;
+}
+
+std::string decodeEntities(absl::string_view text) {
+  std::string result;
+  result.reserve(text.size());
+  for (;;) {
+    auto amp = text.find('&');
+    result.append(text.data(), std::min(amp, text.size()));
+    if (amp == absl::string_view::npos) {
+      return result;
+    }
+    text.remove_prefix(amp);
+    auto semicolon = text.find(';');
+    if (semicolon != absl::string_view::npos && semicolon <= 10 &&
+        decodeEntity(text.substr(1, semicolon - 1), result)) {
+      text.remove_prefix(semicolon + 1);
+    } else {
+      result += '&';
+      text.remove_prefix(1);
+    }
+  }
+}
+
+// Runs of white space (no-break spaces too) become one space; none is kept
+// at either end.
+std::string collapseWhitespace(absl::string_view text) {
+  std::string result;
+  result.reserve(text.size());
+  bool space = false;
+  while (!text.empty()) {
+    size_t width = absl::ascii_isspace(text[0]) ? 1 : absl::StartsWith(text, NBSP) ? NBSP.size() : 0;
+    if (width != 0) {
+      space = true;
+      text.remove_prefix(width);
+      continue;
+    }
+    if (space && !result.empty()) {
+      result += ' ';
+    }
+    space = false;
+    result += text[0];
+    text.remove_prefix(1);
+  }
+  return result;
+}
+
+bool controllerName(absl::string_view text, std::string& name) {
+  if (!absl::StartsWith(text, "Controller: ")) {
+    return false;
+  }
+  name = std::string(absl::StripAsciiWhitespace(text.substr(text.find(':') + 2)));
+  return true;
+}
+
+bool isElement(TidyNode node, absl::string_view name) {
+  auto nodeName = tidyNodeGetName(node);
+  return nodeName != nullptr && absl::EqualsIgnoreCase(nodeName, name);
+}
+
+// All the text under node as tidy decoded it, leaving out nested tables
+// as the streaming pass does.
+void appendText(TidyDoc tdoc, TidyNode node, std::string& text) {
+  for (auto child = tidyGetChild(node); child; child = tidyGetNext(child)) {
+    if (text.size() >= OutletPageParser::MAX_CELL_TEXT) {
+      return;
+    }
+    if (tidyNodeGetType(child) == TidyNode_Text) {
+      TidyBuffer tbuf = {};
+      if (tidyNodeGetValue(tdoc, child, &tbuf) && tbuf.bp != nullptr) {
+        text.append(reinterpret_cast<char *>(tbuf.bp), tbuf.size);
+      }
+      tidyBufFree(&tbuf);
+    } else if (!isElement(child, "table")) {
+      appendText(tdoc, child, text);
+    }
+  }
+}
+
+std::string cellText(TidyDoc tdoc, TidyNode cell) {
+  std::string text;
+  appendText(tdoc, cell, text);
+  return collapseWhitespace(text);
+}
+
+}
+
+void OutletPageParser::reset() {
+  *this = OutletPageParser();
+}
+
+void OutletPageParser::feed(absl::string_view chunk) {
+  while (!chunk.empty()) {
+    switch (mode_) {
+    case MODE_TEXT:
+      {
+      auto end = chunk.find('<');
+      if (wantsText()) {
+        text_.append(chunk.data(), std::min(end, chunk.size()));
+      }
+      if (end == absl::string_view::npos) {
+        return;
+      }
+      chunk.remove_prefix(end + 1);
+      if (!text_.empty()) {
+        text(text_);
+        text_.clear();
+      }
+      mode_ = MODE_TAG;
+      }
+      break;
+    case MODE_TAG:
+      {
+      auto end = chunk.find('>');
+      tag_.append(chunk.data(), std::min(end, chunk.size()));
+      if (end == absl::string_view::npos) {
+        return;
+      }
+      chunk.remove_prefix(end + 1);
+      // a '>' inside a comment does not end it
+      if (absl::StartsWith(tag_, "!--") &&
+          (tag_.size() < 5 || !absl::EndsWith(tag_, "--"))) {
+        tag_ += '>';
+        break;
+      }
+      mode_ = MODE_TEXT;
+      tag(tag_);
+      tag_.clear();
+      }
+      break;
+    case MODE_RAW_TEXT:
+      {
+      // script and style bodies are skipped up to their end tag
+      auto end = chunk.find('<');
+      if (end == absl::string_view::npos) {
+        return;
+      }
+      chunk.remove_prefix(end + 1);
+      rawMatched_ = 0;
+      mode_ = MODE_RAW_END;
+      }
+      break;
+    case MODE_RAW_END:
+      while (!chunk.empty() && rawMatched_ < rawTag_.size() &&
+             absl::ascii_tolower(chunk[0]) == rawTag_[rawMatched_]) {
+        rawMatched_++;
+        chunk.remove_prefix(1);
+      }
+      if (rawMatched_ == rawTag_.size()) {
+        tag_ = rawTag_;
+        mode_ = MODE_TAG;
+      } else if (!chunk.empty()) {
+        mode_ = MODE_RAW_TEXT;
+      }
+      break;
+    }
+  }
+}
+
+bool OutletPageParser::finish() {
+  if (mode_ == MODE_TEXT && !text_.empty()) {
+    text(text_);
+    text_.clear();
+  }
+  endCell();
+  endRow();
+  return haveName_;
+}
+
+bool OutletPageParser::parseWithTidy(absl::string_view page) {
+  reset();
+
+  TidyDocWrapper tdw;
+  TidyBuffer errbuf = {};
+  auto result = tidySetErrorBuffer(tdw, &errbuf);
+  if (result != 0) {
+    std::cerr << "failed to set error buffer: " << result << std::endl;
+    return false;
+  }
+  result = tidyParseString(tdw, std::string(page).c_str());
+  if (result > 1) {
+    std::cerr << "(outlets) failed to parse: " << result << std::endl;
+    std::cerr << "errbuf: " << errbuf.bp << std::endl;
+    tidyBufFree(&errbuf);
+    return false;
+  }
+  tidyBufFree(&errbuf);
+
+  tidyHelper::NodeIndex index(tdw);
+  for (auto th = index.findNode("th", nullptr); th && !haveName_; th = index.findNode("th", th)) {
+    haveName_ = controllerName(cellText(tdw, th), name_);
+  }
+
+  // the row after "Individual Control" holds the column headings, the
+  // ones after it the outlets
+  TidyNode row = nullptr;
+  for (auto td = index.findNode("td", nullptr); td; td = index.findNode("td", td)) {
+    if (absl::StartsWith(cellText(tdw, td), "Individual Control")) {
+      row = tidyGetNext(tidyGetParent(td));
+      break;
+    }
+  }
+  bool headings = true;
+  for (; row; row = tidyGetNext(row)) {
+    if (!isElement(row, "tr")) {
+      continue;
+    }
+    if (headings) {
+      headings = false;
+      continue;
+    }
+    std::string cells[3];
+    size_t count = 0;
+    for (auto cell = tidyGetChild(row); cell; cell = tidyGetNext(cell)) {
+      if (isElement(cell, "td") || isElement(cell, "th")) {
+        if (count < 3) {
+          cells[count] = cellText(tdw, cell);
+        }
+        count++;
+      }
+    }
+    // rows without a state cell are not outlets
+    if (count >= 3) {
+      addOutlet(cells[0], cells[1], cells[2]);
+    }
+  }
+  return haveName_;
+}
+
+void OutletPageParser::tag(absl::string_view tag) {
+  bool closing = absl::StartsWith(tag, "/");
+  if (closing) {
+    tag.remove_prefix(1);
+  }
+  size_t length = 0;
+  while (length < tag.size() && absl::ascii_isalnum(tag[length])) {
+    length++;
+  }
+  // comments, doctype and the like have no name
+  auto name = tag.substr(0, length);
+  if (name.empty()) {
+    return;
+  }
+
+  if (!closing && (absl::EqualsIgnoreCase(name, "script") ||
+                   absl::EqualsIgnoreCase(name, "style"))) {
+    rawTag_ = absl::StrCat("/", absl::AsciiStrToLower(name));
+    mode_ = MODE_RAW_TEXT;
+  } else if (absl::EqualsIgnoreCase(name, "table")) {
+    if (!closing) {
+      tableDepth_++;
+      return;
+    }
+    if (cellDepth_ == tableDepth_) {
+      endCell();
+    }
+    if (tableDepth_ == outletTableDepth_ && phase_ != PHASE_DONE) {
+      endRow();
+      phase_ = PHASE_DONE;
+    }
+    if (tableDepth_ > 0) {
+      tableDepth_--;
+    }
+  } else if (absl::EqualsIgnoreCase(name, "tr")) {
+    // cells and rows may be left unclosed
+    if (cellDepth_ == tableDepth_) {
+      endCell();
+    }
+    if (tableDepth_ != outletTableDepth_) {
+      return;
+    }
+    if (closing) {
+      endRow();
+    } else {
+      startRow();
+    }
+  } else if (absl::EqualsIgnoreCase(name, "td") || absl::EqualsIgnoreCase(name, "th")) {
+    if (cellDepth_ == tableDepth_) {
+      endCell();
+    }
+    if (!closing) {
+      startCell(absl::EqualsIgnoreCase(name, "th"));
+    }
+  }
+}
+
+void OutletPageParser::text(absl::string_view text) {
+  if (!wantsText()) {
+    return;
+  }
+  // inline markup splits a cell's text into several runs
+  cellText_.append(text.data(), std::min(text.size(), MAX_CELL_TEXT - cellText_.size()));
+}
+
+void OutletPageParser::startCell(bool isHeader) {
+  // the innermost cell wins; an enclosing one is dropped
+  cellDepth_ = tableDepth_;
+  cellIsHeader_ = isHeader;
+  cellText_.clear();
+}
+
+void OutletPageParser::endCell() {
+  if (cellDepth_ < 0) {
+    return;
+  }
+  auto depth = cellDepth_;
+  cellDepth_ = -1;
+  auto text = collapseWhitespace(decodeEntities(cellText_));
+
+  if (inRow_ && depth == outletTableDepth_) {
+    if (rowCells_ < 3) {
+      cells_[rowCells_] = std::move(text);
+    }
+    rowCells_++;
+  } else if (cellIsHeader_) {
+    if (!haveName_) {
+      haveName_ = controllerName(text, name_);
+    }
+  } else if (phase_ == PHASE_SEARCHING && absl::StartsWith(text, "Individual Control")) {
+    // the next row holds the column headings, the ones after it the outlets
+    phase_ = PHASE_TITLE_ROW;
+    outletTableDepth_ = depth;
+  }
+}
+
+void OutletPageParser::startRow() {
+  endRow();
+  switch (phase_) {
+  case PHASE_TITLE_ROW:
+    phase_ = PHASE_HEADER_ROW;
+    break;
+  case PHASE_HEADER_ROW:
+    phase_ = PHASE_OUTLET_ROWS;
+    [[fallthrough]];
+  case PHASE_OUTLET_ROWS:
+    inRow_ = true;
+    rowCells_ = 0;
+    break;
+  default:
+    break;
+  }
+}
+
+void OutletPageParser::endRow() {
+  if (!inRow_) {
+    return;
+  }
+  inRow_ = false;
+  // rows without a state cell are not outlets
+  if (rowCells_ < 3) {
+    return;
+  }
+  addOutlet(cells_[0], cells_[1], cells_[2]);
+}
+
+void OutletPageParser::addOutlet(absl::string_view id, absl::string_view name,
+                                 absl::string_view state) {
+  OutletState outletState = OUTLET_STATE_UNKNOWN;
+  if (absl::StartsWith(state, "ON")) {
+    outletState = OUTLET_STATE_ON;
+  } else if (absl::StartsWith(state, "OFF")) {
+    outletState = OUTLET_STATE_OFF;
+  }
+  outlets_.push_back({std::atoi(std::string(id).c_str()), name, outletState});
+}
@@ -0,0 +1,79 @@
+#ifndef __OUTLETPAGEPARSER_H__INCLUDED__
+#define __OUTLETPAGEPARSER_H__INCLUDED__
+
+#include <absl/strings/string_view.h>
+#include <string>
+#include <vector>
+
+#include "webpowerswitch.h"
+
+
+// Pulls the controller name and the "Individual Control" outlet table out
+// of /index.htm while it downloads.  Chunks are fed from the curl write
+// callback, so nothing but the tag or cell text in progress is buffered.
+// Cell text is all the text inside the cell, inline markup included, with
+// entities decoded and whitespace collapsed.
+class OutletPageParser {
+public:
+  // Cell text beyond this is dropped.
+  static const size_t MAX_CELL_TEXT;
+
+  void reset();
+  void feed(absl::string_view chunk);
+  // End of transfer; false unless the controller name was found.
+  bool finish();
+  // Reads the whole page through tidy instead, for markup the streaming
+  // pass cannot follow.  Replaces anything fed; same result as finish().
+  bool parseWithTidy(absl::string_view page);
+  const std::string& name() const {
+    return name_;
+  }
+  std::vector<Outlet>& outlets() {
+    return outlets_;
+  }
+
+private:
+  enum Mode {
+    MODE_TEXT = 0,
+    MODE_TAG,
+    MODE_RAW_TEXT,
+    MODE_RAW_END,
+  };
+  enum Phase {
+    PHASE_SEARCHING = 0,
+    PHASE_TITLE_ROW,
+    PHASE_HEADER_ROW,
+    PHASE_OUTLET_ROWS,
+    PHASE_DONE,
+  };
+  Mode mode_ = MODE_TEXT;
+  Phase phase_ = PHASE_SEARCHING;
+  std::string tag_;
+  std::string rawTag_;
+  size_t rawMatched_ = 0;
+  std::string text_;
+  int tableDepth_ = 0;
+  int outletTableDepth_ = -1;
+  int cellDepth_ = -1;
+  bool cellIsHeader_ = false;
+  std::string cellText_;
+  bool inRow_ = false;
+  size_t rowCells_ = 0;
+  std::string cells_[3];
+  bool haveName_ = false;
+  std::string name_;
+  std::vector<Outlet> outlets_;
+
+  void tag(absl::string_view tag);
+  void text(absl::string_view text);
+  bool wantsText() const {
+    return cellDepth_ >= 0 && cellText_.size() < MAX_CELL_TEXT;
+  }
+  void startCell(bool isHeader);
+  void endCell();
+  void startRow();
+  void endRow();
+  void addOutlet(absl::string_view id, absl::string_view name, absl::string_view state);
+};
+
+#endif  /*  __OUTLETPAGEPARSER_H__INCLUDED__  */
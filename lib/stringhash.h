@@ -0,0 +1,23 @@
+#ifndef __STRINGHASH_H__INCLUDED__
+#define __STRINGHASH_H__INCLUDED__
+
+#include <absl/strings/string_view.h>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+
+// Lets containers keyed by std::string be searched with a string_view
+// without building a temporary std::string.
+struct StringHash {
+  using is_transparent = void;
+  size_t operator()(absl::string_view key) const {
+    return std::hash<std::string_view>{}(std::string_view(key.data(), key.size()));
+  }
+};
+
+template <typename Value>
+using StringMap = std::unordered_map<std::string, Value, StringHash, std::equal_to<>>;
+
+#endif  /*  __STRINGHASH_H__INCLUDED__  */
@@ -0,0 +1,551 @@
+#include "switchcache.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// Everything is stored in host byte order; a cache is not meant to move
+// between machines (export it as YAML for that).
+struct SwitchCache::StringRef {
+  uint32_t offset;
+  uint32_t length;
+};
+
+struct SwitchCache::Header {
+  char magic[4];
+  uint32_t version;
+  uint32_t controllerCount;
+  uint32_t controllerSlots;
+  uint32_t outletCount;
+  uint32_t outletSlots;
+  uint32_t hostSlots;
+  uint32_t outletListSize;
+  uint64_t controllersOffset;
+  uint64_t hostsOffset;
+  uint64_t outletsOffset;
+  // each controller's outlets, as outlet slot numbers sorted by id
+  uint64_t outletListsOffset;
+  uint64_t stringsOffset;
+  uint64_t stringsSize;
+  // one more than the file it replaced
+  uint64_t generation;
+};
+
+// Used for both the by-name and the by-host table; hash is of the key.
+struct SwitchCache::ControllerSlot {
+  uint32_t hash;
+  uint32_t used;
+  StringRef name;
+  StringRef host;
+  int64_t verified;
+  // its part of the outlet lists
+  uint32_t outletsBegin;
+  uint32_t outletsCount;
+};
+
+struct SwitchCache::OutletSlot {
+  uint32_t hash;
+  uint32_t used;
+  StringRef name;
+  StringRef controller;
+  int32_t id;
+  int32_t state;
+  int64_t verified;
+};
+
+namespace {
+
+const char MAGIC[4] = {'W', 'P', 'S', 'C'};
+const uint32_t VERSION = 6;
+
+const char* YAML_KEY_CONTROLLERBYNAME = "controller_by_name";
+const char* YAML_CONTROLLERBYNAME_KEY_HOST = "host";
+const char* YAML_KEY_OUTLETS = "outlets";
+const char* YAML_OUTLETS_KEY_CONTROLLER = "controller";
+const char* YAML_OUTLETS_KEY_ID = "id";
+const char* YAML_OUTLETS_KEY_STATE = "state";
+const char* YAML_KEY_VERIFIED = "verified";
+
+// FNV-1a: stable across processes, unlike std::hash.
+uint32_t hash(absl::string_view key) {
+  uint32_t h = 2166136261u;
+  for (unsigned char c : key) {
+    h = (h ^ c) * 16777619u;
+  }
+  return h;
+}
+
+// Open addressing stays short with the tables at most half full.
+uint32_t slotsFor(size_t count) {
+  uint32_t slots = 1;
+  while (slots < 2 * count) {
+    slots <<= 1;
+  }
+  return slots;
+}
+
+template <typename Slot>
+bool tableFits(uint64_t offset, uint32_t slots, size_t size) {
+  return slots != 0 && (slots & (slots - 1)) == 0 &&
+      offset % alignof(Slot) == 0 && offset <= size &&
+      slots <= (size - offset) / sizeof(Slot);
+}
+
+}  // namespace
+
+SwitchCache::SwitchCache(SwitchCache&& other) {
+  *this = std::move(other);
+}
+
+SwitchCache& SwitchCache::operator=(SwitchCache&& other) {
+  if (this != &other) {
+    unmap();
+    std::swap(base_, other.base_);
+    std::swap(size_, other.size_);
+    addedControllers_ = std::move(other.addedControllers_);
+    addedHosts_ = std::move(other.addedHosts_);
+    addedOutlets_ = std::move(other.addedOutlets_);
+    addedOutletNames_ = std::move(other.addedOutletNames_);
+    removedOutlets_ = std::move(other.removedOutlets_);
+    other.clear();
+  }
+  return *this;
+}
+
+SwitchCache::~SwitchCache() {
+  unmap();
+}
+
+bool SwitchCache::map(int fd) {
+  struct stat statCache;
+  if (fstat(fd, &statCache) != 0 || statCache.st_size < static_cast<off_t>(sizeof(Header))) {
+    return false;
+  }
+  size_t size = statCache.st_size;
+  auto mapped = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (mapped == MAP_FAILED) {
+    return false;
+  }
+
+  auto h = static_cast<const Header*>(mapped);
+  if (memcmp(h->magic, MAGIC, sizeof(MAGIC)) != 0 || h->version != VERSION ||
+      !tableFits<ControllerSlot>(h->controllersOffset, h->controllerSlots, size) ||
+      !tableFits<ControllerSlot>(h->hostsOffset, h->hostSlots, size) ||
+      !tableFits<OutletSlot>(h->outletsOffset, h->outletSlots, size) ||
+      h->outletListsOffset % alignof(uint32_t) != 0 || h->outletListsOffset > size ||
+      h->outletListSize > (size - h->outletListsOffset) / sizeof(uint32_t) ||
+      h->controllerCount >= h->controllerSlots || h->outletCount >= h->outletSlots ||
+      h->stringsOffset > size || h->stringsSize > size - h->stringsOffset) {
+    munmap(mapped, size);
+    return false;
+  }
+  unmap();
+  base_ = static_cast<const char*>(mapped);
+  size_ = size;
+  return true;
+}
+
+bool SwitchCache::write(int fd, uint64_t generation) const {
+  auto output = serialize();
+  memcpy(output.data() + offsetof(Header, generation), &generation, sizeof(generation));
+  size_t written = 0;
+  while (written < output.size()) {
+    auto result = ::write(fd, output.data() + written, output.size() - written);
+    if (result <= 0) {
+      return false;
+    }
+    written += result;
+  }
+  return true;
+}
+
+uint64_t SwitchCache::generation() const {
+  auto h = header();
+  return h == nullptr ? 0 : h->generation;
+}
+
+uint64_t SwitchCache::generation(int fd) {
+  Header h;
+  if (pread(fd, &h, sizeof(h), 0) != static_cast<ssize_t>(sizeof(h)) ||
+      memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0 || h.version != VERSION) {
+    return 0;
+  }
+  return h.generation;
+}
+
+void SwitchCache::importYaml(const YAML::Node& node, time_t verified) {
+  for (auto controller : node[YAML_KEY_CONTROLLERBYNAME]) {
+    addController(controller.first.as<std::string>(),
+                  controller.second[YAML_CONTROLLERBYNAME_KEY_HOST].as<std::string>(),
+                  controller.second[YAML_KEY_VERIFIED].as<time_t>(verified));
+  }
+  for (auto outlet : node[YAML_KEY_OUTLETS]) {
+    addOutlet(outlet.first.as<std::string>(),
+              outlet.second[YAML_OUTLETS_KEY_CONTROLLER].as<std::string>(),
+              outlet.second[YAML_OUTLETS_KEY_ID].as<int>(),
+              outlet.second[YAML_KEY_VERIFIED].as<time_t>(verified),
+              outlet.second[YAML_OUTLETS_KEY_STATE].as<int>(-1));
+  }
+}
+
+YAML::Node SwitchCache::exportYaml() const {
+  YAML::Node node;
+  for (const auto& controller : controllers()) {
+    auto entry = node[YAML_KEY_CONTROLLERBYNAME][controller.name];
+    entry[YAML_CONTROLLERBYNAME_KEY_HOST] = controller.host;
+    entry[YAML_KEY_VERIFIED] = controller.verified;
+  }
+  forEachOutlet([&node](absl::string_view name, absl::string_view controller, int id,
+                        time_t verified, int state) {
+    auto outlet = node[YAML_KEY_OUTLETS][std::string(name)];
+    outlet[YAML_OUTLETS_KEY_CONTROLLER] = std::string(controller);
+    outlet[YAML_OUTLETS_KEY_ID] = id;
+    outlet[YAML_OUTLETS_KEY_STATE] = state;
+    outlet[YAML_KEY_VERIFIED] = verified;
+  });
+  return node;
+}
+
+bool SwitchCache::empty() const {
+  if (!addedControllers_.empty() || !addedOutlets_.empty()) {
+    return false;
+  }
+  auto h = header();
+  return h == nullptr || (h->controllerCount == 0 && h->outletCount == 0);
+}
+
+void SwitchCache::clear() {
+  unmap();
+  addedControllers_.clear();
+  addedHosts_.clear();
+  addedOutlets_.clear();
+  addedOutletNames_.clear();
+  removedOutlets_.clear();
+}
+
+bool SwitchCache::findController(absl::string_view name, absl::string_view& host,
+                                 time_t* verified) const {
+  auto added = addedControllers_.find(name);
+  if (added != addedControllers_.end()) {
+    host = added->second.host;
+    if (verified != nullptr) {
+      *verified = added->second.verified;
+    }
+    return true;
+  }
+  auto h = header();
+  if (h == nullptr) {
+    return false;
+  }
+  auto slot = findSlot(h->controllersOffset, h->controllerSlots, name, false);
+  if (slot == nullptr) {
+    return false;
+  }
+  host = string(slot->host);
+  if (verified != nullptr) {
+    *verified = slot->verified;
+  }
+  return true;
+}
+
+bool SwitchCache::findControllerByHost(absl::string_view host, absl::string_view& name) const {
+  // Either table may hold a host whose controller has moved on since, so
+  // the answer is checked against the current host of that controller.
+  absl::string_view current;
+  auto added = addedHosts_.find(host);
+  if (added != addedHosts_.end() && findController(added->second, current) && current == host) {
+    name = added->second;
+    return true;
+  }
+  auto h = header();
+  if (h == nullptr) {
+    return false;
+  }
+  auto slot = findSlot(h->hostsOffset, h->hostSlots, host, true);
+  if (slot == nullptr || !findController(string(slot->name), current) || current != host) {
+    return false;
+  }
+  name = string(slot->name);
+  return true;
+}
+
+bool SwitchCache::findOutlet(absl::string_view name, absl::string_view& controller, int& id,
+                             time_t* verified, int* state) const {
+  auto added = addedOutlets_.find(name);
+  if (added != addedOutlets_.end()) {
+    controller = added->second.controller;
+    id = added->second.id;
+    if (verified != nullptr) {
+      *verified = added->second.verified;
+    }
+    if (state != nullptr) {
+      *state = added->second.state;
+    }
+    return true;
+  }
+  auto slot = findOutletSlot(name);
+  if (slot == nullptr || removedOutlets_.contains(name)) {
+    return false;
+  }
+  controller = string(slot->controller);
+  id = slot->id;
+  if (verified != nullptr) {
+    *verified = slot->verified;
+  }
+  if (state != nullptr) {
+    *state = slot->state;
+  }
+  return true;
+}
+
+std::vector<SwitchCache::Controller> SwitchCache::controllers() const {
+  std::vector<Controller> result;
+  for (const auto& [name, added] : addedControllers_) {
+    result.push_back({name, added.host, added.verified});
+  }
+  if (auto h = header()) {
+    auto slots = reinterpret_cast<const ControllerSlot*>(base_ + h->controllersOffset);
+    for (uint32_t i = 0; i < h->controllerSlots; i++) {
+      if (slots[i].used && !addedControllers_.contains(string(slots[i].name))) {
+        result.push_back({std::string(string(slots[i].name)), std::string(string(slots[i].host)),
+                          static_cast<time_t>(slots[i].verified)});
+      }
+    }
+  }
+  std::sort(result.begin(), result.end(),
+            [](const Controller& a, const Controller& b) { return a.name < b.name; });
+  return result;
+}
+
+std::vector<SwitchCache::OutletEntry> SwitchCache::outlets(absl::string_view controller) const {
+  std::vector<OutletEntry> result;
+  auto added = addedOutletNames_.find(controller);
+  if (added != addedOutletNames_.end()) {
+    for (const auto& name : added->second) {
+      const auto& outlet = addedOutlets_.find(name)->second;
+      result.push_back({name, outlet.id, outlet.state, outlet.verified});
+    }
+  }
+  auto h = header();
+  auto slot = h == nullptr ? nullptr : findSlot(h->controllersOffset, h->controllerSlots, controller, false);
+  if (slot != nullptr && slot->outletsBegin <= h->outletListSize &&
+      slot->outletsCount <= h->outletListSize - slot->outletsBegin) {
+    auto list = reinterpret_cast<const uint32_t*>(base_ + h->outletListsOffset) + slot->outletsBegin;
+    auto slots = reinterpret_cast<const OutletSlot*>(base_ + h->outletsOffset);
+    for (uint32_t i = 0; i < slot->outletsCount; i++) {
+      if (list[i] >= h->outletSlots || !slots[list[i]].used) {
+        continue;
+      }
+      const auto& outlet = slots[list[i]];
+      auto name = string(outlet.name);
+      if (!overridden(name)) {
+        result.push_back({std::string(name), outlet.id, outlet.state,
+                          static_cast<time_t>(outlet.verified)});
+      }
+    }
+  }
+  std::sort(result.begin(), result.end(),
+            [](const OutletEntry& a, const OutletEntry& b) { return a.id < b.id; });
+  return result;
+}
+
+void SwitchCache::addController(absl::string_view name, absl::string_view host, time_t verified) {
+  addedControllers_[std::string(name)] = {std::string(host), verified};
+  addedHosts_[std::string(host)] = std::string(name);
+}
+
+void SwitchCache::addOutlet(absl::string_view name, absl::string_view controller, int id,
+                            time_t verified, int state) {
+  auto& outlet = addedOutlets_[std::string(name)];
+  if (!outlet.controller.empty() && outlet.controller != controller) {
+    addedOutletNames_[outlet.controller].erase(std::string(name));
+  }
+  outlet = {std::string(controller), id, verified, state};
+  addedOutletNames_[std::string(controller)].emplace(name);
+  removedOutlets_.erase(std::string(name));
+}
+
+void SwitchCache::replaceOutlets(absl::string_view controller,
+                                 const std::vector<OutletEntry>& outlets) {
+  for (const auto& old : this->outlets(controller)) {
+    if (std::none_of(outlets.begin(), outlets.end(),
+                     [&old](const OutletEntry& outlet) { return outlet.name == old.name; })) {
+      removeOutlet(old.name);
+    }
+  }
+  for (const auto& outlet : outlets) {
+    addOutlet(outlet.name, controller, outlet.id, outlet.verified, outlet.state);
+  }
+}
+
+void SwitchCache::removeOutlet(absl::string_view name) {
+  auto added = addedOutlets_.find(name);
+  if (added != addedOutlets_.end()) {
+    addedOutletNames_[added->second.controller].erase(std::string(name));
+    addedOutlets_.erase(added);
+  }
+  removedOutlets_.emplace(name);
+}
+
+bool SwitchCache::overridden(absl::string_view name) const {
+  return addedOutlets_.contains(name) || removedOutlets_.contains(name);
+}
+
+const SwitchCache::Header* SwitchCache::header() const {
+  return base_ == nullptr ? nullptr : reinterpret_cast<const Header*>(base_);
+}
+
+absl::string_view SwitchCache::string(const StringRef& ref) const {
+  auto h = header();
+  if (h == nullptr || ref.offset > h->stringsSize || ref.length > h->stringsSize - ref.offset) {
+    return {};
+  }
+  return absl::string_view(base_ + h->stringsOffset + ref.offset, ref.length);
+}
+
+const SwitchCache::ControllerSlot* SwitchCache::findSlot(uint64_t offset, uint32_t slots,
+                                                        absl::string_view key, bool byHost) const {
+  auto table = reinterpret_cast<const ControllerSlot*>(base_ + offset);
+  auto mask = slots - 1;
+  auto keyHash = hash(key);
+  for (uint32_t probe = 0, i = keyHash & mask; probe < slots && table[i].used;
+       probe++, i = (i + 1) & mask) {
+    if (table[i].hash == keyHash && string(byHost ? table[i].host : table[i].name) == key) {
+      return &table[i];
+    }
+  }
+  return nullptr;
+}
+
+const SwitchCache::OutletSlot* SwitchCache::findOutletSlot(absl::string_view name) const {
+  auto h = header();
+  if (h == nullptr) {
+    return nullptr;
+  }
+  auto slots = reinterpret_cast<const OutletSlot*>(base_ + h->outletsOffset);
+  auto mask = h->outletSlots - 1;
+  auto key = hash(name);
+  for (uint32_t probe = 0, i = key & mask; probe < h->outletSlots && slots[i].used;
+       probe++, i = (i + 1) & mask) {
+    if (slots[i].hash == key && string(slots[i].name) == name) {
+      return &slots[i];
+    }
+  }
+  return nullptr;
+}
+
+void SwitchCache::forEachOutlet(const std::function<void(absl::string_view name, absl::string_view controller,
+                                                         int id, time_t verified, int state)>& each) const {
+  for (const auto& [name, outlet] : addedOutlets_) {
+    each(name, outlet.controller, outlet.id, outlet.verified, outlet.state);
+  }
+  if (auto h = header()) {
+    auto slots = reinterpret_cast<const OutletSlot*>(base_ + h->outletsOffset);
+    for (uint32_t i = 0; i < h->outletSlots; i++) {
+      if (slots[i].used && !overridden(string(slots[i].name))) {
+        each(string(slots[i].name), string(slots[i].controller), slots[i].id, slots[i].verified,
+             slots[i].state);
+      }
+    }
+  }
+}
+
+std::string SwitchCache::serialize() const {
+  std::string strings;
+  auto addString = [&strings](absl::string_view value) {
+    StringRef ref = {static_cast<uint32_t>(strings.size()), static_cast<uint32_t>(value.size())};
+    strings.append(value.data(), value.size());
+    return ref;
+  };
+
+  // Outlets first: each controller slot refers to its outlets' slots.
+  size_t outletCount = 0;
+  forEachOutlet([&outletCount](absl::string_view, absl::string_view, int, time_t, int) {
+    outletCount++;
+  });
+  std::vector<OutletSlot> outletSlots(slotsFor(outletCount));
+  std::map<std::string, std::vector<std::pair<int, uint32_t>>, std::less<>> outletsOf;
+  forEachOutlet([&](absl::string_view name, absl::string_view controller, int id, time_t verified,
+                    int state) {
+    auto key = hash(name);
+    auto i = key & (outletSlots.size() - 1);
+    while (outletSlots[i].used) {
+      i = (i + 1) & (outletSlots.size() - 1);
+    }
+    outletSlots[i] = {key, 1, addString(name), addString(controller), id, state, verified};
+    outletsOf[std::string(controller)].push_back({id, i});
+  });
+
+  auto controllerList = controllers();
+  std::vector<ControllerSlot> controllerSlots(slotsFor(controllerList.size()));
+  std::vector<ControllerSlot> hostSlots(slotsFor(controllerList.size()));
+  std::vector<uint32_t> outletLists;
+  for (const auto& controller : controllerList) {
+    auto begin = static_cast<uint32_t>(outletLists.size());
+    auto owned = outletsOf.find(controller.name);
+    if (owned != outletsOf.end()) {
+      std::sort(owned->second.begin(), owned->second.end());
+      for (const auto& [id, slot] : owned->second) {
+        outletLists.push_back(slot);
+      }
+    }
+    auto count = static_cast<uint32_t>(outletLists.size()) - begin;
+
+    auto name = addString(controller.name);
+    auto host = addString(controller.host);
+    auto key = hash(controller.name);
+    auto i = key & (controllerSlots.size() - 1);
+    while (controllerSlots[i].used) {
+      i = (i + 1) & (controllerSlots.size() - 1);
+    }
+    controllerSlots[i] = {key, 1, name, host, controller.verified, begin, count};
+    key = hash(controller.host);
+    i = key & (hostSlots.size() - 1);
+    while (hostSlots[i].used) {
+      i = (i + 1) & (hostSlots.size() - 1);
+    }
+    hostSlots[i] = {key, 1, name, host, controller.verified, begin, count};
+  }
+
+  Header h = {};
+  memcpy(h.magic, MAGIC, sizeof(MAGIC));
+  h.version = VERSION;
+  h.controllerCount = controllerList.size();
+  h.controllerSlots = controllerSlots.size();
+  h.outletCount = outletCount;
+  h.outletSlots = outletSlots.size();
+  h.hostSlots = hostSlots.size();
+  h.outletListSize = outletLists.size();
+  h.controllersOffset = sizeof(Header);
+  h.hostsOffset = h.controllersOffset + controllerSlots.size() * sizeof(ControllerSlot);
+  h.outletsOffset = h.hostsOffset + hostSlots.size() * sizeof(ControllerSlot);
+  h.outletListsOffset = h.outletsOffset + outletSlots.size() * sizeof(OutletSlot);
+  h.stringsOffset = h.outletListsOffset + outletLists.size() * sizeof(uint32_t);
+  h.stringsSize = strings.size();
+
+  std::string output;
+  output.reserve(h.stringsOffset + strings.size());
+  output.append(reinterpret_cast<const char*>(&h), sizeof(h));
+  output.append(reinterpret_cast<const char*>(controllerSlots.data()),
+                controllerSlots.size() * sizeof(ControllerSlot));
+  output.append(reinterpret_cast<const char*>(hostSlots.data()),
+                hostSlots.size() * sizeof(ControllerSlot));
+  output.append(reinterpret_cast<const char*>(outletSlots.data()),
+                outletSlots.size() * sizeof(OutletSlot));
+  output.append(reinterpret_cast<const char*>(outletLists.data()),
+                outletLists.size() * sizeof(uint32_t));
+  output.append(strings);
+  return output;
+}
+
+void SwitchCache::unmap() {
+  if (base_ != nullptr) {
+    munmap(const_cast<char*>(base_), size_);
+    base_ = nullptr;
+    size_ = 0;
+  }
+}
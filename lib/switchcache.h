@@ -0,0 +1,110 @@
+#ifndef __SWITCHCACHE_H__INCLUDED__
+#define __SWITCHCACHE_H__INCLUDED__
+
+#include <absl/strings/string_view.h>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <yaml-cpp/yaml.h>
+
+
+// Controller name to host (and back) and outlet name to (controller, id,
+// state), each entry with the time it was last seen on the switch.
+// A cache file is mapped read-only and searched through the hash tables
+// stored in it; entries added since sit in memory on top until write().
+// Views returned by the find functions last until clear() or destruction.
+class SwitchCache {
+public:
+  struct Controller {
+    std::string name;
+    std::string host;
+    time_t verified;
+  };
+  struct OutletEntry {
+    std::string name;
+    int id;
+    // an OutletState
+    int state;
+    time_t verified;
+  };
+
+  SwitchCache() = default;
+  SwitchCache(const SwitchCache&) = delete;
+  SwitchCache(SwitchCache&& other);
+  SwitchCache& operator=(SwitchCache&& other);
+  ~SwitchCache();
+
+  // Replaces the mapped file; false (and the old one kept) unless fd holds
+  // a cache written by write().  Entries added in memory are kept.
+  bool map(int fd);
+  bool write(int fd, uint64_t generation) const;
+  // Generation of the mapped file, or of the cache in fd; 0 if none.
+  uint64_t generation() const;
+  static uint64_t generation(int fd);
+  // Entries without a time of their own get verified.
+  void importYaml(const YAML::Node& node, time_t verified = 0);
+  YAML::Node exportYaml() const;
+  bool empty() const;
+  void clear();
+
+  bool findController(absl::string_view name, absl::string_view& host,
+                      time_t* verified = nullptr) const;
+  bool findControllerByHost(absl::string_view host, absl::string_view& name) const;
+  bool findOutlet(absl::string_view name, absl::string_view& controller, int& id,
+                  time_t* verified = nullptr, int* state = nullptr) const;
+  // All controllers, sorted by name.
+  std::vector<Controller> controllers() const;
+  // Outlets of controller, sorted by id.
+  std::vector<OutletEntry> outlets(absl::string_view controller) const;
+  void addController(absl::string_view name, absl::string_view host, time_t verified);
+  void addOutlet(absl::string_view name, absl::string_view controller, int id, time_t verified,
+                 int state);
+  // The outlets of controller become these; any others it had are dropped.
+  void replaceOutlets(absl::string_view controller, const std::vector<OutletEntry>& outlets);
+
+private:
+  struct Header;
+  struct StringRef;
+  struct ControllerSlot;
+  struct OutletSlot;
+  struct AddedController {
+    std::string host;
+    time_t verified;
+  };
+  struct AddedOutlet {
+    std::string controller;
+    int id;
+    time_t verified;
+    int state;
+  };
+
+  const char* base_ = nullptr;
+  size_t size_ = 0;
+  std::map<std::string, AddedController, std::less<>> addedControllers_;
+  // may hold hosts a controller has since moved away from
+  std::map<std::string, std::string, std::less<>> addedHosts_;
+  std::map<std::string, AddedOutlet, std::less<>> addedOutlets_;
+  // names in addedOutlets_ by controller
+  std::map<std::string, std::set<std::string, std::less<>>, std::less<>> addedOutletNames_;
+  // outlets of the mapped file that are gone
+  std::set<std::string, std::less<>> removedOutlets_;
+
+  const Header* header() const;
+  absl::string_view string(const StringRef& ref) const;
+  const ControllerSlot* findSlot(uint64_t offset, uint32_t slots, absl::string_view key,
+                                 bool byHost) const;
+  const OutletSlot* findOutletSlot(absl::string_view name) const;
+  // An outlet of the mapped file that was replaced or removed since.
+  bool overridden(absl::string_view name) const;
+  void removeOutlet(absl::string_view name);
+  void forEachOutlet(const std::function<void(absl::string_view name, absl::string_view controller,
+                                              int id, time_t verified, int state)>& each) const;
+  std::string serialize() const;
+  void unmap();
+};
+
+#endif  /*  __SWITCHCACHE_H__INCLUDED__  */
@@ -0,0 +1,280 @@
+#include "switchdiscovery.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <iostream>
+#include <sys/resource.h>
+
+#include "tcpprobe.h"
+
+
+SwitchDiscovery::SwitchDiscovery(const std::vector<UsernamePassword>& credentials,
+                                 size_t maxProbes, ConnectionPool* pool)
+: credentials_(credentials), maxProbes_(std::max<size_t>(maxProbes, 1)), pool_(pool) {
+}
+
+SwitchDiscovery::~SwitchDiscovery() {
+  for (auto& [handle, probe] : inFlight_) {
+    if (multi_ != nullptr) {
+      curl_multi_remove_handle(multi_, handle);
+    }
+  }
+  inFlight_.clear();
+  if (multi_ != nullptr) {
+    curl_multi_cleanup(multi_);
+  }
+}
+
+void SwitchDiscovery::addRange(absl::string_view label, unsigned long firstIp, unsigned long lastIp) {
+  if (firstIp <= lastIp) {
+    Range range;
+    range.stats.label = std::string(label);
+    range.firstIp = firstIp;
+    range.nextIp = firstIp;
+    range.lastIp = lastIp;
+    ranges_.push_back(std::move(range));
+  }
+}
+
+void SwitchDiscovery::addHost(absl::string_view host) {
+  // Explicit hosts share one address-less range of their own.
+  if (ranges_.empty() || ranges_.back().stats.label != "hosts" ||
+      ranges_.back().firstIp <= ranges_.back().lastIp) {
+    Range range;
+    range.stats.label = "hosts";
+    range.firstIp = range.nextIp = 1;
+    range.lastIp = 0;
+    ranges_.push_back(std::move(range));
+  }
+  ranges_.back().hosts.emplace_back(host);
+  ranges_.back().stats.addresses++;
+}
+
+void SwitchDiscovery::excludeHost(absl::string_view host) {
+  struct in_addr address;
+  if (inet_pton(AF_INET, std::string(host).c_str(), &address) == 1) {
+    excludedIps_.insert(ntohl(address.s_addr));
+  }
+}
+
+std::vector<SwitchDiscovery::RangeStats> SwitchDiscovery::stats() const {
+  std::vector<RangeStats> result;
+  for (const auto& range : ranges_) {
+    result.push_back(range.stats);
+  }
+  return result;
+}
+
+size_t SwitchDiscovery::probesStarted() const {
+  size_t probes = 0;
+  for (const auto& range : ranges_) {
+    probes += range.stats.probes;
+  }
+  return probes;
+}
+
+void SwitchDiscovery::run(const FoundCallback& found) {
+  if (credentials_.empty()) {
+    return;
+  }
+  start_ = std::chrono::steady_clock::now();
+  if (connectTimeout_.count() > 0) {
+    preProbe();
+  }
+  multi_ = curl_multi_init();
+
+  startProbes();
+  while (!inFlight_.empty()) {
+    int running = 0;
+    CURLMcode mc = curl_multi_perform(multi_, &running);
+    if (mc != CURLM_OK) {
+      std::cerr << "curl_multi_perform failed: " << curl_multi_strerror(mc) << std::endl;
+      break;
+    }
+
+    CURLMsg* msg;
+    int msgsLeft;
+    while ((msg = curl_multi_info_read(multi_, &msgsLeft))) {
+      if (msg->msg == CURLMSG_DONE) {
+        complete(msg->easy_handle, msg->data.result, found);
+      }
+    }
+    startProbes();
+
+    if (running > 0) {
+      // Block only until a socket is ready or curl's next internal timer.
+      long timeout = -1;
+      curl_multi_timeout(multi_, &timeout);
+      if (timeout < 0 || timeout > 1000) {
+        timeout = 1000;
+      }
+      mc = curl_multi_poll(multi_, nullptr, 0, static_cast<int>(timeout), nullptr);
+      if (mc != CURLM_OK) {
+        std::cerr << "curl_multi_poll failed: " << curl_multi_strerror(mc) << std::endl;
+        break;
+      }
+    }
+  }
+
+  // Whatever is left over (multi error) is still handed back.
+  for (auto& [handle, probe] : inFlight_) {
+    curl_multi_remove_handle(multi_, handle);
+    ranges_[probe.range].inFlight--;
+    found(std::move(probe.wps));
+  }
+  inFlight_.clear();
+  curl_multi_cleanup(multi_);
+  multi_ = nullptr;
+  for (auto& range : ranges_) {
+    checkDone(range);
+  }
+}
+
+void SwitchDiscovery::preProbe() {
+  auto start = std::chrono::steady_clock::now();
+  // Plain sockets are cheap, but stay well clear of the descriptor limit.
+  size_t maxConnects = maxProbes_ * 4 * std::max<size_t>(ranges_.size(), 1);
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+    maxConnects = std::min<size_t>(maxConnects, limit.rlim_cur > 64 ? limit.rlim_cur - 64 : 1);
+  }
+
+  // Hand out addresses round robin so every range progresses together.
+  size_t nextRange = 0;
+  TcpProbe probe(80, connectTimeout_, maxConnects);
+  probe.run(
+    [this, &nextRange](unsigned long& ip) {
+      for (size_t tried = 0; tried < ranges_.size(); tried++) {
+        auto& range = ranges_[nextRange];
+        nextRange = (nextRange + 1) % ranges_.size();
+        if (nextRangeIp(range, ip)) {
+          range.stats.addresses++;
+          return true;
+        }
+      }
+      return false;
+    },
+    [this](unsigned long ip) {
+      for (auto& range : ranges_) {
+        if (range.firstIp <= ip && ip <= range.lastIp) {
+          struct in_addr address = { htonl(ip) };
+          range.hosts.push_back(inet_ntoa(address));
+          range.stats.accepted++;
+          if (verbose_ > 1) {
+            std::cout << "accepting connections: " << range.hosts.back() << std::endl;
+          }
+          break;
+        }
+      }
+    });
+
+  if (verbose_) {
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "pre-probe: time: " << elapsed.count() << "s" << std::endl;
+    for (const auto& range : ranges_) {
+      std::cout << "  " << range.stats.label << ": " << range.stats.accepted << " of "
+                << range.stats.addresses << " addresses accepted connections" << std::endl;
+    }
+  }
+}
+
+bool SwitchDiscovery::nextRangeIp(Range& range, unsigned long& ip) {
+  while (range.nextIp <= range.lastIp) {
+    ip = range.nextIp++;
+    if (excludedIps_.count(ip) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool SwitchDiscovery::startProbe(size_t rangeIndex) {
+  auto& range = ranges_[rangeIndex];
+  std::string host;
+  unsigned long ip;
+  if (range.nextHost < range.hosts.size()) {
+    host = range.hosts[range.nextHost++];
+  } else if (nextRangeIp(range, ip)) {
+    struct in_addr testIp = { htonl(ip) };
+    host = inet_ntoa(testIp);
+    range.stats.addresses++;
+  } else {
+    return false;
+  }
+  if (verbose_ > 1) {
+    std::cout << "ip: " << host << std::endl;
+  }
+
+  auto wps = std::make_unique<WebPowerSwitch>(host, pool_);
+  wps->verbose(verbose_);
+  wps->suppressDetectionErrors();
+  CURL* request = wps->startLogin(credentials_);
+  if (request == nullptr) {
+    return true;
+  }
+  curl_multi_add_handle(multi_, request);
+  inFlight_.emplace(request, Probe{std::move(wps), rangeIndex});
+  range.inFlight++;
+  range.stats.probes++;
+  return true;
+}
+
+void SwitchDiscovery::startProbes() {
+  // Round robin, one probe per range per pass, each within its own budget.
+  bool started = true;
+  while (started) {
+    started = false;
+    for (size_t i = 0; i < ranges_.size(); i++) {
+      if (ranges_[i].inFlight < maxProbes_ && startProbe(i)) {
+        started = true;
+      }
+    }
+  }
+  for (auto& range : ranges_) {
+    checkDone(range);
+  }
+  peakInFlight_ = std::max(peakInFlight_, inFlight_.size());
+}
+
+void SwitchDiscovery::complete(CURL* handle, CURLcode result, const FoundCallback& found) {
+  auto node = inFlight_.extract(handle);
+  if (node.empty()) {
+    return;
+  }
+  auto& probe = node.mapped();
+  auto& wps = probe.wps;
+  if (verbose_ > 2) {
+    std::cout << "done: " << wps->host() << std::endl;
+  }
+  curl_multi_remove_handle(multi_, handle);
+
+  CURL* request = nullptr;
+  if (result == CURLE_OK) {
+    request = wps->next();
+  } else {
+    wps->logout();
+  }
+  if (request != nullptr) {
+    // Same switch, next step of its login: re-key it under the new handle.
+    curl_multi_add_handle(multi_, request);
+    node.key() = request;
+    inFlight_.insert(std::move(node));
+    return;
+  }
+  auto& range = ranges_[probe.range];
+  range.inFlight--;
+  if (wps->isLoggedIn()) {
+    range.stats.found++;
+  }
+  found(std::move(wps));
+}
+
+void SwitchDiscovery::checkDone(Range& range) {
+  if (range.done || range.inFlight > 0 || range.nextHost < range.hosts.size() ||
+      range.nextIp <= range.lastIp) {
+    return;
+  }
+  range.done = true;
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_;
+  range.stats.seconds = elapsed.count();
+}
@@ -0,0 +1,95 @@
+#ifndef __SWITCHDISCOVERY_H__INCLUDED__
+#define __SWITCHDISCOVERY_H__INCLUDED__
+
+#include <chrono>
+#include <curl/curl.h>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "webpowerswitch.h"
+
+
+// Drives the login state machine of many WebPowerSwitch probes (one per
+// host, trying every credential in turn) over one curl multi handle.
+// Probes are started lazily and every completion is dispatched straight to
+// its switch through the in-flight map, so the loop costs O(1) per event
+// regardless of range size.
+// Each range (subnet) gets its own budget of maxProbes in flight and its own
+// statistics; all ranges are swept together, round robin, in the one loop.
+// Address ranges are first swept with a plain TCP connect (see TcpProbe);
+// only addresses that accept on port 80 are handed to the login stage.
+class SwitchDiscovery {
+public:
+  using FoundCallback = std::function<void(std::unique_ptr<WebPowerSwitch>&&)>;
+  struct RangeStats {
+    std::string label;
+    size_t addresses = 0;
+    size_t accepted = 0;
+    size_t probes = 0;
+    size_t found = 0;
+    double seconds = 0;
+  };
+
+  SwitchDiscovery(const std::vector<UsernamePassword>& credentials,
+                  size_t maxProbes, ConnectionPool* pool = nullptr);
+  SwitchDiscovery(const SwitchDiscovery&) = delete;
+  ~SwitchDiscovery();
+  void addRange(absl::string_view label, unsigned long firstIp, unsigned long lastIp);
+  // Known hosts (ip or name) skip the pre-probe and go straight to login.
+  void addHost(absl::string_view host);
+  // Addresses within a range that must not be probed (e.g. already confirmed).
+  void excludeHost(absl::string_view host);
+  void run(const FoundCallback& found);
+  void verbose(int increment = 1) {
+    verbose_ += increment;
+  }
+  // zero disables the TCP pre-probe: every address gets a login attempt
+  void connectTimeout(std::chrono::milliseconds timeout) {
+    connectTimeout_ = timeout;
+  }
+  std::vector<RangeStats> stats() const;
+  size_t probesStarted() const;
+  size_t peakInFlight() const {
+    return peakInFlight_;
+  }
+
+private:
+  struct Range {
+    RangeStats stats;
+    unsigned long firstIp;
+    unsigned long nextIp;
+    unsigned long lastIp;
+    std::vector<std::string> hosts;
+    size_t nextHost = 0;
+    size_t inFlight = 0;
+    bool done = false;
+  };
+  struct Probe {
+    std::unique_ptr<WebPowerSwitch> wps;
+    size_t range;
+  };
+  const std::vector<UsernamePassword>& credentials_;
+  size_t maxProbes_;
+  ConnectionPool* pool_;
+  std::vector<Range> ranges_;
+  std::unordered_set<unsigned long> excludedIps_;
+  std::chrono::milliseconds connectTimeout_ { 500 };
+  std::chrono::steady_clock::time_point start_;
+  CURLM* multi_ = nullptr;
+  std::unordered_map<CURL*, Probe> inFlight_;
+  size_t peakInFlight_ = 0;
+  int verbose_ { 0 };
+
+  void preProbe();
+  bool nextRangeIp(Range& range, unsigned long& ip);
+  bool startProbe(size_t rangeIndex);
+  void startProbes();
+  void complete(CURL* handle, CURLcode result, const FoundCallback& found);
+  void checkDone(Range& range);
+};
+
+#endif  /*  __SWITCHDISCOVERY_H__INCLUDED__  */
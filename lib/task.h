@@ -0,0 +1,95 @@
+#ifndef __TASK_H__INCLUDED__
+#define __TASK_H__INCLUDED__
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+
+// A coroutine producing a T, started only when awaited (co_await from
+// another coroutine) or handed to EventLoop::start.  The result is read once,
+// after done().
+template <typename T>
+class Task {
+public:
+  struct promise_type {
+    std::optional<T> value;
+    // whoever awaits this task; resumed when it finishes
+    std::coroutine_handle<> continuation;
+
+    Task get_return_object() {
+      return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    std::suspend_always initial_suspend() noexcept {
+      return {};
+    }
+    struct FinalAwaiter {
+      bool await_ready() noexcept {
+        return false;
+      }
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+        auto continuation = handle.promise().continuation;
+        return continuation ? continuation : std::noop_coroutine();
+      }
+      void await_resume() noexcept {
+      }
+    };
+    FinalAwaiter final_suspend() noexcept {
+      return {};
+    }
+    void return_value(T result) {
+      value = std::move(result);
+    }
+    void unhandled_exception() {
+      std::terminate();
+    }
+  };
+
+  Task(Task&& other) noexcept
+  : handle_(std::exchange(other.handle_, {})) {}
+  Task& operator=(Task&& other) noexcept {
+    if (this != &other) {
+      if (handle_) {
+        handle_.destroy();
+      }
+      handle_ = std::exchange(other.handle_, {});
+    }
+    return *this;
+  }
+  Task(const Task&) = delete;
+  ~Task() {
+    if (handle_) {
+      handle_.destroy();
+    }
+  }
+
+  bool done() const {
+    return handle_ && handle_.done();
+  }
+  T result() {
+    return std::move(*handle_.promise().value);
+  }
+  std::coroutine_handle<> handle() const {
+    return handle_;
+  }
+
+  bool await_ready() const noexcept {
+    return false;
+  }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+    handle_.promise().continuation = awaiting;
+    return handle_;
+  }
+  T await_resume() {
+    return result();
+  }
+
+private:
+  explicit Task(std::coroutine_handle<promise_type> handle)
+  : handle_(handle) {}
+
+  std::coroutine_handle<promise_type> handle_;
+};
+
+#endif  /*  __TASK_H__INCLUDED__  */
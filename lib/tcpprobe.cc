@@ -0,0 +1,129 @@
+#include "tcpprobe.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+TcpProbe::TcpProbe(uint16_t port, std::chrono::milliseconds timeout, size_t maxInFlight)
+: port_(port), timeout_(timeout), maxInFlight_(std::max<size_t>(maxInFlight, 1)) {
+}
+
+TcpProbe::~TcpProbe() {
+  for (auto& [fd, pending] : pending_) {
+    close(fd);
+  }
+  if (epollFd_ >= 0) {
+    close(epollFd_);
+  }
+}
+
+bool TcpProbe::run(const NextAddress& nextAddress, const Accepted& accepted) {
+  epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epollFd_ < 0) {
+    std::cerr << "epoll_create1 failed: " << errno << " " << strerror(errno) << std::endl;
+    return false;
+  }
+
+  // Every connect gets the same timeout, so start order is deadline order.
+  // Entries whose socket already finished are skipped when they reach the front.
+  std::deque<std::pair<int, Pending>> expiry;
+  const int MAX_EVENTS = 64;
+  struct epoll_event events[MAX_EVENTS];
+  bool more = true;
+  while (more || !pending_.empty()) {
+    while (more && pending_.size() < maxInFlight_) {
+      unsigned long ip;
+      more = nextAddress(ip);
+      if (more) {
+        auto fd = start(ip, accepted);
+        if (fd >= 0) {
+          expiry.push_back({fd, pending_[fd]});
+        }
+      }
+    }
+    if (pending_.empty()) {
+      continue;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+        expiry.front().second.deadline - now).count();
+    auto count = epoll_wait(epollFd_, events, MAX_EVENTS, std::max<long>(wait, 0));
+    if (count < 0 && errno != EINTR) {
+      std::cerr << "epoll_wait failed: " << errno << " " << strerror(errno) << std::endl;
+      return false;
+    }
+    for (int i = 0; i < count; i++) {
+      int fd = events[i].data.fd;
+      int error = 0;
+      socklen_t length = sizeof(error);
+      getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length);
+      finish(fd, error == 0 && (events[i].events & (EPOLLERR | EPOLLHUP)) == 0, accepted);
+    }
+
+    now = std::chrono::steady_clock::now();
+    while (!expiry.empty() && expiry.front().second.deadline <= now) {
+      auto [fd, queued] = expiry.front();
+      expiry.pop_front();
+      auto iter = pending_.find(fd);
+      // fd numbers are reused, so only expire the connect that was queued
+      if (iter != pending_.end() && iter->second.ip == queued.ip &&
+          iter->second.deadline == queued.deadline) {
+        finish(fd, false, accepted);
+      }
+    }
+  }
+  return true;
+}
+
+int TcpProbe::start(unsigned long ip, const Accepted& accepted) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    std::cerr << "socket failed: " << errno << " " << strerror(errno) << std::endl;
+    return -1;
+  }
+  struct sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port_);
+  address.sin_addr.s_addr = htonl(ip);
+  if (connect(fd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) == 0) {
+    close(fd);
+    accepted(ip);
+    return -1;
+  }
+  if (errno != EINPROGRESS) {
+    close(fd);
+    return -1;
+  }
+
+  struct epoll_event event = {};
+  event.events = EPOLLOUT;
+  event.data.fd = fd;
+  if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &event) != 0) {
+    close(fd);
+    return -1;
+  }
+  pending_[fd] = {ip, std::chrono::steady_clock::now() + timeout_};
+  return fd;
+}
+
+void TcpProbe::finish(int fd, bool connected, const Accepted& accepted) {
+  auto iter = pending_.find(fd);
+  if (iter == pending_.end()) {
+    return;
+  }
+  auto ip = iter->second.ip;
+  pending_.erase(iter);
+  // closing the fd also removes it from the epoll set
+  close(fd);
+  if (connected) {
+    accepted(ip);
+  }
+}
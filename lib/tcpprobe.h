@@ -0,0 +1,39 @@
+#ifndef __TCPPROBE_H__INCLUDED__
+#define __TCPPROBE_H__INCLUDED__
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+
+
+// Batched non-blocking TCP connect sweep driven by epoll.  Used as the cheap
+// first stage of discovery so that only hosts with something listening on
+// the port get a full HTTP login attempt.
+class TcpProbe {
+public:
+  // Returns false when there are no more addresses (host byte order).
+  using NextAddress = std::function<bool(unsigned long& ip)>;
+  using Accepted = std::function<void(unsigned long ip)>;
+
+  TcpProbe(uint16_t port, std::chrono::milliseconds timeout, size_t maxInFlight);
+  TcpProbe(const TcpProbe&) = delete;
+  ~TcpProbe();
+  bool run(const NextAddress& nextAddress, const Accepted& accepted);
+
+private:
+  struct Pending {
+    unsigned long ip;
+    std::chrono::steady_clock::time_point deadline;
+  };
+  uint16_t port_;
+  std::chrono::milliseconds timeout_;
+  size_t maxInFlight_;
+  int epollFd_ = -1;
+  std::unordered_map<int, Pending> pending_;
+
+  int start(unsigned long ip, const Accepted& accepted);
+  void finish(int fd, bool connected, const Accepted& accepted);
+};
+
+#endif  /*  __TCPPROBE_H__INCLUDED__  */
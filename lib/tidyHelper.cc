@@ -1,79 +1,127 @@
 #include "tidyHelper.h"
 
+#include <absl/strings/ascii.h>
+#include <absl/strings/match.h>
+#include <algorithm>
 #include <iostream>
 #include <tidy/tidybuffio.h>
 
 namespace tidyHelper {
 
-TidyNode findNode(TidyNode tnod, absl::string_view name, TidyNode& prevNode) {
-  if (tnod == nullptr)
-    return nullptr;
-  for (auto child = tidyGetChild(tnod); child; child = tidyGetNext(child)) {
+NodeIndex::NodeIndex(TidyDoc tdoc)
+: tdoc_(tdoc) {
+  auto root = tidyGetRoot(tdoc);
+  if (root != nullptr) {
+    add(root);
+  }
+}
+
+void NodeIndex::add(TidyNode node) {
+  for (auto child = tidyGetChild(node); child; child = tidyGetNext(child)) {
+    auto order = order_.size();
+    order_[child] = order;
     auto nodeName = tidyNodeGetName(child);
     if (nodeName != nullptr) {
-      if (strncasecmp(nodeName, name.data(), strlen(nodeName)) == 0) {
-        if (prevNode == nullptr) {
-          return child;
-        }
-        if (prevNode == child) {
-          prevNode = nullptr;
-        }
-      }
+      nodes_[absl::AsciiStrToLower(nodeName)].push_back({order, child, false, {}});
     }
+    add(child);
+  }
+}
+
+const std::vector<NodeIndex::Entry>* NodeIndex::entries(absl::string_view name) const {
+  auto found = nodes_.find(absl::AsciiStrToLower(name));
+  if (found == nodes_.end()) {
+    return nullptr;
+  }
+  return &found->second;
+}
+
+size_t NodeIndex::firstAfter(const std::vector<Entry>& entries, TidyNode prevNode) const {
+  if (prevNode == nullptr) {
+    return 0;
+  }
+  auto found = order_.find(prevNode);
+  if (found == order_.end()) {
+    return entries.size();
+  }
+  auto order = found->second;
+  return std::upper_bound(entries.begin(), entries.end(), order,
+                          [](size_t order, const Entry& entry) { return order < entry.order; })
+      - entries.begin();
+}
 
-    auto foundNode = findNode(child, name, prevNode);
-    if (foundNode != nullptr) {
-      return foundNode;
+const std::string& NodeIndex::leadingText(const Entry& entry) const {
+  if (!entry.textCached) {
+    entry.textCached = true;
+    auto child = tidyGetChild(entry.node);
+    if (tidyNodeGetType(child) == TidyNode_Text) {
+      TidyBuffer tbuf = {};
+      if (tidyNodeGetText(tdoc_, child, &tbuf) == false) {
+        std::cout << "tidyNodeGetText failed" << std::endl;
+      } else if (tbuf.bp != nullptr) {
+        entry.text.assign(reinterpret_cast<char *>(tbuf.bp), tbuf.size);
+      }
+      tidyBufFree(&tbuf);
     }
   }
-  return nullptr;
+  return entry.text;
 }
 
-TidyNode findNode(TidyDoc tdoc, absl::string_view name, TidyNode prevNode) {
-  return findNode(tidyGetRoot(tdoc), name, prevNode);
+TidyNode NodeIndex::findNode(absl::string_view name, TidyNode prevNode) const {
+  auto nodes = entries(name);
+  if (nodes == nullptr) {
+    return nullptr;
+  }
+  auto index = firstAfter(*nodes, prevNode);
+  return index < nodes->size() ? (*nodes)[index].node : nullptr;
 }
 
-TidyNode findNodeByAttr(TidyDoc tdoc, absl::string_view name,
-                        TidyAttrId attrId, absl::string_view attrValue,
-                        TidyNode prevNode) {
-  auto node = findNode(tdoc, name, prevNode);
-  while (node != nullptr) {
-    auto value = tidyAttrGetById(node, attrId);
+TidyNode NodeIndex::findNodeByAttr(absl::string_view name, TidyAttrId attrId,
+                                   absl::string_view attrValue, TidyNode prevNode) const {
+  auto nodes = entries(name);
+  if (nodes == nullptr) {
+    return nullptr;
+  }
+  for (auto index = firstAfter(*nodes, prevNode); index < nodes->size(); index++) {
+    auto value = tidyAttrGetById((*nodes)[index].node, attrId);
     if (value != nullptr) {
       auto valueValue = tidyAttrValue(value);
-      if (strncasecmp(valueValue, attrValue.data(), strlen(valueValue)) == 0) {
-        return node;
+      if (valueValue != nullptr && absl::EqualsIgnoreCase(valueValue, attrValue)) {
+        return (*nodes)[index].node;
       }
     }
-    node = findNode(tdoc, name, node);
   }
   return nullptr;
 }
 
-TidyNode findNodeByContent(TidyDoc tdoc, absl::string_view name,
-                           absl::string_view content, TidyNode prevNode) {
-  auto node = findNode(tdoc, name, prevNode);
-  while (node != nullptr) {
-    auto child = tidyGetChild(node);
-    if (tidyNodeGetType(child) == TidyNode_Text) {
-      TidyBuffer tbuf = {};
-      if (tidyNodeGetText(tdoc, child, &tbuf) == false) {
-        std::cout << "tidyNodeGetText failed" << std::endl;
-      } else {
-        if (content.length() <= tbuf.size &&
-            strncmp(content.data(), reinterpret_cast<char *>(tbuf.bp), content.length()) == 0) {
-          if (prevNode == nullptr) {
-            return child;
-          }
-          if (prevNode == child) {
-            prevNode = nullptr;
-          }
-        }
-      }
+TidyNode NodeIndex::findNodeByContent(absl::string_view name, absl::string_view content,
+                                      TidyNode prevNode) const {
+  auto nodes = entries(name);
+  if (nodes == nullptr) {
+    return nullptr;
+  }
+  for (auto index = firstAfter(*nodes, prevNode); index < nodes->size(); index++) {
+    const auto& text = leadingText((*nodes)[index]);
+    if (!text.empty() && absl::StartsWith(text, content)) {
+      return tidyGetChild((*nodes)[index].node);
     }
-    node = findNode(tdoc, name, node);
   }
   return nullptr;
 }
 
+TidyNode findNode(TidyDoc tdoc, absl::string_view name, TidyNode prevNode) {
+  return NodeIndex(tdoc).findNode(name, prevNode);
+}
+
+TidyNode findNodeByAttr(TidyDoc tdoc, absl::string_view name,
+                        TidyAttrId attrId, absl::string_view attrValue,
+                        TidyNode prevNode) {
+  return NodeIndex(tdoc).findNodeByAttr(name, attrId, attrValue, prevNode);
+}
+
+TidyNode findNodeByContent(TidyDoc tdoc, absl::string_view name,
+                           absl::string_view content, TidyNode prevNode) {
+  return NodeIndex(tdoc).findNodeByContent(name, content, prevNode);
+}
+
 }
@@ -2,10 +2,44 @@
 #define __TIDYHELPER_H__INCLUDED__
 
 #include <absl/strings/string_view.h>
+#include <string>
 #include <tidy/tidy.h>
+#include <unordered_map>
+#include <vector>
 
 namespace tidyHelper {
 
+// Built in one walk of a parsed document: element name to its nodes in
+// document order, so repeated lookups do not re-walk the tree.  prevNode
+// continues a search after that node, as with the free functions below.
+class NodeIndex {
+public:
+  explicit NodeIndex(TidyDoc tdoc);
+  NodeIndex(const NodeIndex&) = delete;
+  TidyNode findNode(absl::string_view name, TidyNode prevNode) const;
+  TidyNode findNodeByAttr(absl::string_view name, TidyAttrId attrId,
+                          absl::string_view attrValue, TidyNode prevNode) const;
+  // Returns the leading text child whose text starts with content.
+  TidyNode findNodeByContent(absl::string_view name, absl::string_view content,
+                             TidyNode prevNode) const;
+
+private:
+  struct Entry {
+    size_t order;
+    TidyNode node;
+    mutable bool textCached = false;
+    mutable std::string text;
+  };
+  TidyDoc tdoc_;
+  std::unordered_map<TidyNode, size_t> order_;
+  std::unordered_map<std::string, std::vector<Entry>> nodes_;
+
+  void add(TidyNode node);
+  const std::vector<Entry>* entries(absl::string_view name) const;
+  size_t firstAfter(const std::vector<Entry>& entries, TidyNode prevNode) const;
+  const std::string& leadingText(const Entry& entry) const;
+};
+
 TidyNode findNode(TidyDoc tdoc, absl::string_view name, TidyNode prevNode);
 TidyNode findNodeByAttr(TidyDoc tdoc, absl::string_view name,
                         TidyAttrId attrId, absl::string_view attrValue,
@@ -1,15 +1,19 @@
 #include "webpowerswitch.h"
 
+#include <absl/strings/match.h>
 #include <absl/strings/str_cat.h>
+#include <algorithm>
 #include <iostream>
+#include <sstream>
 #include <string.h>
 #include <tidy/tidybuffio.h>
 #include <unordered_map>
 
+#include "loginpagescanner.h"
 #include "md5Helper.h"
+#include "outletpageparser.h"
 #include "tidyHelper.h"
 #include "tidydocwrapper.h"
-#include "trim.h"
 
 
 const long WebPowerSwitch::CURL_TIMEOUT = 5L;
@@ -24,11 +28,19 @@ std::string generatePostData(std::unordered_map<std::string, std::string>& field
   return os.str();
 }
 
-size_t writeFunctionStream(char* ptr, size_t size, size_t nmemb,
-                           std::ostream* ostr) {
-  
+size_t writeFunctionBuffer(char* ptr, size_t size, size_t nmemb,
+                           std::string* buffer) {
   auto totalBytes = size * nmemb;
-  ostr->write(ptr, totalBytes);
+  buffer->append(ptr, totalBytes);
+  return totalBytes;
+}
+
+size_t WebPowerSwitch::writeFunctionParser(char* ptr, size_t size, size_t nmemb,
+                                           WebPowerSwitch* wps) {
+  auto totalBytes = size * nmemb;
+  wps->outletParser_->feed(absl::string_view(ptr, totalBytes));
+  // kept for the tidy fallback
+  wps->response_.append(ptr, totalBytes);
   return totalBytes;
 }
 
@@ -104,8 +116,12 @@ int my_trace(CURL *handle, curl_infotype type,
   return 0;
 }
 
-WebPowerSwitch::WebPowerSwitch(absl::string_view host)
-  : host_(host) {
+WebPowerSwitch::WebPowerSwitch(absl::string_view host, ConnectionPool* pool)
+  : host_(host), pool_(pool) {
+  if (pool_ == nullptr) {
+    ownPool_ = std::make_unique<ConnectionPool>();
+    pool_ = ownPool_.get();
+  }
 }
 
 WebPowerSwitch::~WebPowerSwitch() {
@@ -113,15 +129,35 @@ WebPowerSwitch::~WebPowerSwitch() {
 }
 
 bool WebPowerSwitch::login(absl::string_view username, absl::string_view password) {
+  return login({{std::string(username), std::string(password)}});
+}
+
+bool WebPowerSwitch::login(const std::vector<UsernamePassword>& credentials) {
   // first page
-  auto request = startLogin(username, password);
+  auto request = startLogin(credentials);
   while (request != nullptr && curl_easy_perform(request) == CURLE_OK) {
     request = next();
   }
   return isLoggedIn();
 }
 
+Task<bool> WebPowerSwitch::loginAsync(EventLoop& loop, std::vector<UsernamePassword> credentials) {
+  auto request = startLogin(credentials);
+  while (request != nullptr) {
+    if (co_await loop.perform(request) != CURLE_OK) {
+      logout();
+      break;
+    }
+    request = next();
+  }
+  co_return isLoggedIn();
+}
+
 CURL* WebPowerSwitch::startLogin(absl::string_view username, absl::string_view password) {
+  return startLogin({{std::string(username), std::string(password)}});
+}
+
+CURL* WebPowerSwitch::startLogin(const std::vector<UsernamePassword>& credentials) {
   if (loggedIn_) {
     return nullptr;
   }
@@ -131,16 +167,12 @@ CURL* WebPowerSwitch::startLogin(absl::string_view username, absl::string_view p
   if (request_ != nullptr) {
     return nullptr;
   }
+  if (credentials.empty()) {
+    return nullptr;
+  }
 
-  username_ = std::string(username);
-  password_ = std::string(password);
-
-  // Create Share
-  share_ = curl_share_init();
-
-  curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
-  curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_COOKIE);
-  curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  credentials_ = credentials;
+  credential_ = 0;
 
   // Fetch
   initializeRequest();
@@ -163,91 +195,12 @@ CURL* WebPowerSwitch::next() {
     clearRequest();
     return nullptr;
   case STATE_INITIAL_PAGE_REQUESTED:
-    {
 		dumpCookies();
     clearRequest();
-    // Parse
-    TidyDocWrapper tdw;
-    TidyBuffer errbuf = {};
-    auto result = tidySetErrorBuffer(tdw, &errbuf);
-    if (result != 0) {
-      std::cerr << "failed to set error buffer: " << result << std::endl;
-      return nullptr;
-    }
-    result = tidyOptSetInt(tdw, TidyUseCustomTags, TidyCustomBlocklevel);
-    if (result == false) {
-      std::cerr << "tidyOptSetInt(tdw, TidyUseCustomTags, TidyCustomBlocklevel) failed: " << result << std::endl;
-      std::cerr << "errbuf: " << errbuf.bp << std::endl;
-      return nullptr;
-    }
-    result = tidyParseString(tdw, os_.str().c_str());
-    if (result > 1) {
-      std::cerr << "(initial page) failed to parse: " << result << std::endl;
-      std::cerr << "errbuf: " << errbuf.bp << std::endl;
-      return nullptr;
-    }
-
-    // Find Challenge value
-    TidyNode inputNode = tidyHelper::findNodeByAttr(tdw, "input", TidyAttr_NAME, "challenge", nullptr);
-    if (inputNode == nullptr) {
-      if (!detectionErrorsAreSuppressed()) {
-        std::cerr << "host(): " << host() << " failed to find input" << std::endl;
-      }
+    if (parseLoginPage() == false) {
       return nullptr;
     }
-    auto value = tidyAttrGetById(inputNode, TidyAttr_VALUE);
-    if (value == nullptr) {
-      std::cerr << "failed to find challenge value" << std::endl;
-      return nullptr;
-    }
-    std::string challenge = tidyAttrValue(value);
-
-    // determine form action
-    TidyNode formNode = tidyHelper::findNodeByAttr(tdw, "form", TidyAttr_NAME, "login", nullptr);
-    if (formNode == nullptr) {
-      std::cerr << "failed to find form" << std::endl;
-      return nullptr;
-    }
-    value = tidyAttrGetById(formNode, TidyAttr_ACTION);
-    if (value == nullptr) {
-      std::cerr << "failed to find action value" << std::endl;
-      return nullptr;
-    }
-    std::string action = tidyAttrValue(value);
-    if (action[0] != '/') {
-      action = '/' + action;
-    }
-
-    // create password
-    auto passphrase = challenge + username_ + password_ + challenge;
-    //std::cout << "passphrase: " << passphrase << std::endl;
-    std::vector<unsigned char> md5digest = md5Helper::calculate(
-        reinterpret_cast<const unsigned char*>(passphrase.c_str()),
-        passphrase.length());
-    std::ostringstream osDigest;
-    for (unsigned char uc : md5digest) {
-      osDigest << std::setfill('0') << std::setw(2) << std::hex << (int)uc;
-    }
-    std::unordered_map<std::string, std::string> postFields;
-    postFields["Username"] = username_;
-    postFields["Password"] = osDigest.str();
-
-    initializeRequest();
-
-    curl_easy_setopt(request_, CURLOPT_URL, absl::StrCat(prefix_, host(), action).c_str());
-    curl_easy_setopt(request_, CURLOPT_HEADER, 1L);
-    curl_easy_setopt(request_, CURLOPT_COOKIEFILE, "");
-    curl_easy_setopt(request_, CURLOPT_SHARE, share_);
-    curl_easy_setopt(request_, CURLOPT_TIMEOUT, CURL_TIMEOUT);
-    if (verbose_ > 2) {
-      curl_easy_setopt(request_, CURLOPT_VERBOSE, 1L);
-    }
-    curl_easy_setopt(request_, CURLOPT_FOLLOWLOCATION, 1L);
-
-    auto postData = generatePostData(postFields);
-    curl_easy_setopt(request_, CURLOPT_COPYPOSTFIELDS, postData.c_str());
-    state_ = STATE_LOGIN_REQUESTED;
-    }
+    prepLoginRequest();
     return request_;
   case STATE_LOGIN_REQUESTED:
     dumpCookies();
@@ -258,11 +211,22 @@ CURL* WebPowerSwitch::next() {
       loggedIn_ = true;
       prepToFetchOutlets();
       return request_;
+    } else if (credential_ + 1 < credentials_.size()) {
+      // Same host, next credential.  Use the fresh challenge if the switch
+      // sent its login page back, otherwise answer the one already parsed.
+      if (verbose_) {
+        std::cout << "host(): " << host() << " login failed for: "
+                  << credentials_[credential_].username << std::endl;
+      }
+      credential_++;
+      retryChallenge();
+      prepLoginRequest();
+      return request_;
     } else {
       state_ = STATE_LOGIN_FAILED;
       if (!detectionErrorsAreSuppressed()) {
         std::cout << "host(): " << host() << " responseCode: " << responseCode << std::endl;
-        std::cout << "os_: " << os_.str() << std::endl;
+        std::cout << "response: " << response() << std::endl;
       }
     }
     break;
@@ -271,81 +235,26 @@ CURL* WebPowerSwitch::next() {
     dumpCookies();
     clearRequest();
 
-    TidyDocWrapper tdw;
-    TidyBuffer errbuf = {};
-    auto result = tidySetErrorBuffer(tdw, &errbuf);
-    if (result != 0) {
-      std::cerr << "failed to set error buffer: " << result << std::endl;
-      return nullptr;
-    }
-    result = tidyParseString(tdw, os_.str().c_str());
-    if (result > 1) {
-      std::cerr << "(outlets) failed to parse: " << result << std::endl;
-      std::cerr << "errbuf: " << errbuf.bp << std::endl;
-      return nullptr;
-    }
-
-    // find name
-    auto node = tidyHelper::findNodeByContent(tdw, "th", "Controller: ", nullptr);
-    if (node == nullptr) {
-      std::cerr << "findNodeByContent failed (" << host() << ") 'th' 'Controller: '" << std::endl;
-      return nullptr;
-    }
-    TidyBuffer tbuf = {};
-    tidyNodeGetText(tdw, node, &tbuf);
-    if (tbuf.bp == nullptr) {
-      std::cerr << "tidyNodeGetText failed (" << host() << ") tbuf.bp == nullptr" << std::endl;
-      return nullptr;
-    }
-    name_ = trim(reinterpret_cast<char *>(tbuf.bp));
-    name_ = name_.substr(name_.find(':') + 2);
-
-    // find individual control
-    node = tidyHelper::findNodeByContent(tdw, "td", "Individual Control", nullptr);
-    auto tr = tidyGetParent(tidyGetParent(node));
-    tr = tidyHelper::findNode(tdw, "tr", tr);
-    tr = tidyHelper::findNode(tdw, "tr", tr);
-    while (tr) {
-      Outlet outlet;
-
-      auto td = tidyGetChild(tr);
-      auto number = tidyGetChild(td);
-      TidyBuffer tbuf = {};
-      tidyNodeGetText(tdw, number, &tbuf);
-      int outletId = atoi(reinterpret_cast<char *>(tbuf.bp));
-
-      td = tidyGetNext(td);
-      auto name = tidyGetChild(td);
-      tidyBufClear(&tbuf);
-      tidyNodeGetText(tdw, name, &tbuf);
-      std::string outletName = reinterpret_cast<char *>(tbuf.bp);
-      outletName = trim(outletName);
-
-      auto tdNext = tidyGetNext(td);
-      if (tdNext == nullptr) {
-        std::cerr << "tidyGetNext failed (" << host() << ") td: " << td << std::endl;
-        tr = tidyGetNext(tr);
-        continue;
+    // The page was parsed as it arrived; tidy reads it again if that
+    // missed the name or the outlets.
+    if (outletParser_->finish() == false || outletParser_->outlets().empty()) {
+      if (verbose_ > 1) {
+        std::cout << "host(): " << host() << " outlet page parse failed, using tidy" << std::endl;
       }
-      td = tdNext;
-      auto state = tidyGetChild(td);
-      while (tidyNodeGetType(state) != TidyNode_Text) {
-        state = tidyGetChild(state);
+      if (outletParser_->parseWithTidy(response()) == false) {
+        if (!detectionErrorsAreSuppressed()) {
+          std::cerr << "controller name not found (" << host() << ")" << std::endl;
+        }
+        return nullptr;
       }
-      tidyBufClear(&tbuf);
-      tidyNodeGetText(tdw, state, &tbuf);
-      OutletState outletState = OUTLET_STATE_UNKNOWN;
-      if (strncmp("ON", reinterpret_cast<char *>(tbuf.bp), 2) == 0) {
-        outletState = OUTLET_STATE_ON;
-      } else if (strncmp("OFF", reinterpret_cast<char *>(tbuf.bp), 3) == 0) {
-        outletState = OUTLET_STATE_OFF;
-      }
-
-      outlets_.push_back({outletId, outletName, outletState});
-
-      tr = tidyGetNext(tr);
     }
+    name_ = outletParser_->name();
+    outlets_.swap(outletParser_->outlets());
+    indexOutlets();
     state_ = STATE_OUTLETS_BUILT;
+    outletsRead_ = time(nullptr);
+    outletsVerified_ = true;
+    assumedOutlets_.clear();
     }
     break;
   default:
@@ -355,31 +264,230 @@ CURL* WebPowerSwitch::next() {
   return nullptr;
 }
 
+bool WebPowerSwitch::resume(const std::vector<std::string>& cookies) {
+  if (loggedIn_ || state_ != STATE_UNINITIALIZED || cookies.empty()) {
+    return false;
+  }
+  addCookies(cookies);
+
+  // An expired session lands on the login page instead of the outlets, so
+  // parse failures are expected here and are not reported.
+  auto suppressDetectionErrors = suppressDetectionErrors_;
+  suppressDetectionErrors_ = true;
+  loggedIn_ = true;
+  buildOutlets();
+  suppressDetectionErrors_ = suppressDetectionErrors;
+  if (state_ != STATE_OUTLETS_BUILT) {
+    logout();
+    return false;
+  }
+  return true;
+}
+
+Task<bool> WebPowerSwitch::resumeAsync(EventLoop& loop, std::vector<std::string> cookies) {
+  if (loggedIn_ || state_ != STATE_UNINITIALIZED || cookies.empty()) {
+    co_return false;
+  }
+  addCookies(cookies);
+
+  auto suppressDetectionErrors = suppressDetectionErrors_;
+  suppressDetectionErrors_ = true;
+  loggedIn_ = true;
+  prepToFetchOutlets();
+  if (co_await loop.perform(request_) == CURLE_OK) {
+    next();
+  }
+  suppressDetectionErrors_ = suppressDetectionErrors;
+  if (state_ != STATE_OUTLETS_BUILT) {
+    logout();
+    co_return false;
+  }
+  co_return true;
+}
+
+void WebPowerSwitch::addCookies(const std::vector<std::string>& cookies) {
+  CURL* handle = pool_->acquire();
+  for (const auto& cookie : cookies) {
+    curl_easy_setopt(handle, CURLOPT_COOKIELIST, cookie.c_str());
+  }
+  pool_->release(handle);
+}
+
+std::vector<std::string> WebPowerSwitch::sessionCookies() {
+  std::vector<std::string> result;
+  if (loggedIn_ == false) {
+    return result;
+  }
+  // The share holds every switch's cookies; keep only this host's.
+  CURL* handle = pool_->acquire();
+  struct curl_slist* cookies = nullptr;
+  if (curl_easy_getinfo(handle, CURLINFO_COOKIELIST, &cookies) == CURLE_OK) {
+    for (auto each = cookies; each; each = each->next) {
+      absl::string_view cookie(each->data);
+      if (cookie.substr(0, 10) == "#HttpOnly_") {
+        cookie.remove_prefix(10);
+      }
+      auto domain = cookie.substr(0, cookie.find('\t'));
+      if (domain == host_) {
+        result.emplace_back(each->data);
+      }
+    }
+    curl_slist_free_all(cookies);
+  }
+  pool_->release(handle);
+  return result;
+}
+
 void WebPowerSwitch::logout() {
   state_ = STATE_UNINITIALIZED;
   loggedIn_ = false;
   clearRequest();
-  if (share_ != nullptr) {
-    curl_share_cleanup(share_);
-    share_ = nullptr;
-  }
 }
 
 void WebPowerSwitch::initializeRequest() {
   clearRequest();
-  request_ = curl_easy_init();
-  curl_easy_setopt(request_, CURLOPT_WRITEFUNCTION, writeFunctionStream);
-  os_.seekp(0);
-  os_.str("");
-  curl_easy_setopt(request_, CURLOPT_WRITEDATA, &os_);
+  request_ = pool_->acquire();
+  curl_easy_setopt(request_, CURLOPT_WRITEFUNCTION, writeFunctionBuffer);
+  response_.clear();
+  curl_easy_setopt(request_, CURLOPT_WRITEDATA, &response_);
   if (verbose_ > 2) {
     curl_easy_setopt(request_, CURLOPT_DEBUGFUNCTION, my_trace);
   }
 }
 
+bool WebPowerSwitch::parseLoginPage() {
+  absl::string_view challengeView;
+  absl::string_view actionView;
+  if (loginPageScanner::scan(response(), challengeView, actionView) && !actionView.empty()) {
+    challenge_ = std::string(challengeView);
+    responses_.clear();
+    loginAction_ = std::string(actionView);
+    if (loginAction_[0] != '/') {
+      loginAction_ = '/' + loginAction_;
+    }
+    return true;
+  }
+  if (verbose_ > 1) {
+    std::cout << "host(): " << host() << " login page scan failed, using tidy" << std::endl;
+  }
+
+  TidyDocWrapper tdw;
+  TidyBuffer errbuf = {};
+  auto result = tidySetErrorBuffer(tdw, &errbuf);
+  if (result != 0) {
+    std::cerr << "failed to set error buffer: " << result << std::endl;
+    return false;
+  }
+  result = tidyOptSetInt(tdw, TidyUseCustomTags, TidyCustomBlocklevel);
+  if (result == false) {
+    std::cerr << "tidyOptSetInt(tdw, TidyUseCustomTags, TidyCustomBlocklevel) failed: " << result << std::endl;
+    std::cerr << "errbuf: " << errbuf.bp << std::endl;
+    return false;
+  }
+  result = tidyParseString(tdw, response_.c_str());
+  if (result > 1) {
+    std::cerr << "(initial page) failed to parse: " << result << std::endl;
+    std::cerr << "errbuf: " << errbuf.bp << std::endl;
+    return false;
+  }
+
+  tidyHelper::NodeIndex index(tdw);
+
+  // Find Challenge value
+  TidyNode inputNode = index.findNodeByAttr("input", TidyAttr_NAME, "challenge", nullptr);
+  if (inputNode == nullptr) {
+    if (!detectionErrorsAreSuppressed()) {
+      std::cerr << "host(): " << host() << " failed to find input" << std::endl;
+    }
+    return false;
+  }
+  auto value = tidyAttrGetById(inputNode, TidyAttr_VALUE);
+  if (value == nullptr) {
+    std::cerr << "failed to find challenge value" << std::endl;
+    return false;
+  }
+  std::string challenge = tidyAttrValue(value);
+
+  // determine form action
+  TidyNode formNode = index.findNodeByAttr("form", TidyAttr_NAME, "login", nullptr);
+  if (formNode == nullptr) {
+    std::cerr << "failed to find form" << std::endl;
+    return false;
+  }
+  value = tidyAttrGetById(formNode, TidyAttr_ACTION);
+  if (value == nullptr) {
+    std::cerr << "failed to find action value" << std::endl;
+    return false;
+  }
+  std::string action = tidyAttrValue(value);
+  if (action[0] != '/') {
+    action = '/' + action;
+  }
+
+  challenge_ = challenge;
+  responses_.clear();
+  loginAction_ = action;
+  return true;
+}
+
+void WebPowerSwitch::retryChallenge() {
+  // The reply may be anything from a fresh login page to an empty body, so
+  // a failed parse is not reported and leaves the old challenge in place.
+  auto challenge = challenge_;
+  auto responses = responses_;
+  auto loginAction = loginAction_;
+  auto suppressDetectionErrors = suppressDetectionErrors_;
+  suppressDetectionErrors_ = true;
+  auto parsed = parseLoginPage();
+  suppressDetectionErrors_ = suppressDetectionErrors;
+  if (parsed == false) {
+    challenge_.swap(challenge);
+    responses_.swap(responses);
+    loginAction_.swap(loginAction);
+  } else if (challenge_ == challenge) {
+    // Same challenge: the answers already computed still hold.
+    responses_.swap(responses);
+  }
+}
+
+void WebPowerSwitch::prepLoginRequest() {
+  const auto& up = credentials_[credential_];
+
+  // Answer every credential's challenge in one batch; later attempts
+  // against the same challenge reuse it.
+  if (responses_.size() != credentials_.size()) {
+    std::vector<std::string> passphrases;
+    for (const auto& each : credentials_) {
+      passphrases.push_back(challenge_ + each.username + each.password + challenge_);
+    }
+    responses_.clear();
+    for (const auto& digest : md5Helper::digests(passphrases)) {
+      responses_.push_back(md5Helper::toHex(digest));
+    }
+  }
+  std::unordered_map<std::string, std::string> postFields;
+  postFields["Username"] = up.username;
+  postFields["Password"] = responses_[credential_];
+
+  initializeRequest();
+
+  curl_easy_setopt(request_, CURLOPT_URL, absl::StrCat(prefix_, host(), loginAction_).c_str());
+  curl_easy_setopt(request_, CURLOPT_HEADER, 1L);
+  curl_easy_setopt(request_, CURLOPT_COOKIEFILE, "");
+  curl_easy_setopt(request_, CURLOPT_TIMEOUT, CURL_TIMEOUT);
+  if (verbose_ > 2) {
+    curl_easy_setopt(request_, CURLOPT_VERBOSE, 1L);
+  }
+  curl_easy_setopt(request_, CURLOPT_FOLLOWLOCATION, 1L);
+
+  auto postData = generatePostData(postFields);
+  curl_easy_setopt(request_, CURLOPT_COPYPOSTFIELDS, postData.c_str());
+  state_ = STATE_LOGIN_REQUESTED;
+}
+
 void WebPowerSwitch::clearRequest() {
   if (request_ != nullptr) {
-    curl_easy_cleanup(request_);
+    pool_->release(request_);
     request_ = nullptr;
   }
 }
@@ -410,12 +518,18 @@ void WebPowerSwitch::prepToFetchOutlets() {
 
   name_.clear();
   outlets_.clear();
+  outletIndex_.clear();
 
   initializeRequest();
+  if (outletParser_ == nullptr) {
+    outletParser_ = std::make_unique<OutletPageParser>();
+  }
+  outletParser_->reset();
+  curl_easy_setopt(request_, CURLOPT_WRITEFUNCTION, writeFunctionParser);
+  curl_easy_setopt(request_, CURLOPT_WRITEDATA, this);
   curl_easy_setopt(request_, CURLOPT_URL, absl::StrCat(prefix_, host(),  "/index.htm").c_str());
   curl_easy_setopt(request_, CURLOPT_HEADER, 1L);
   curl_easy_setopt(request_, CURLOPT_COOKIEFILE, "");
-  curl_easy_setopt(request_, CURLOPT_SHARE, share_);
   curl_easy_setopt(request_, CURLOPT_TIMEOUT, CURL_TIMEOUT);
   if (verbose_ > 2) {
     curl_easy_setopt(request_, CURLOPT_VERBOSE, 1L);
@@ -439,25 +553,60 @@ void WebPowerSwitch::buildOutlets() {
   next();
 }
 
+bool WebPowerSwitch::refresh() {
+  buildOutlets();
+  return state_ == STATE_OUTLETS_BUILT;
+}
+
+Task<bool> WebPowerSwitch::refreshAsync(EventLoop& loop) {
+  if (loggedIn_ == false) {
+    std::cerr << "not logged in" << std::endl;
+    co_return false;
+  }
+  prepToFetchOutlets();
+  if (co_await loop.perform(request_) == CURLE_OK) {
+    next();
+  }
+  co_return state_ == STATE_OUTLETS_BUILT;
+}
+
+bool WebPowerSwitch::verify() {
+  if (outletsVerified_) {
+    return state_ == STATE_OUTLETS_BUILT;
+  }
+  return refresh();
+}
+
 void WebPowerSwitch::dumpOutlets(std::ostream& ostr) {
   if (state_ != STATE_OUTLETS_BUILT) {
     ostr << "host: " << host_ << " - no outlets built" << std::endl;
     return;
   }
-  ostr << "controller: " << name_ << std::endl;
+  dumpOutlets(ostr, name_, outlets_);
+}
+
+void WebPowerSwitch::dumpOutlets(std::ostream& ostr, absl::string_view name,
+                                 const std::vector<Outlet>& outlets) {
+  ostr << "controller: " << name << std::endl;
   ostr << " #  State  Name" << std::endl;
-  for (auto outlet : outlets_) {
+  for (auto outlet : outlets) {
     ostr << outlet << std::endl;
   }
 }
 
+void WebPowerSwitch::indexOutlets() {
+  outletIndex_.clear();
+  for (size_t index = 0; index < outlets_.size(); index++) {
+    outletIndex_.emplace(outlets_[index].name(), index);
+  }
+}
+
 Outlet* WebPowerSwitch::getOutlet(absl::string_view name) {
-  for (auto outletIter = outlets_.begin(); outletIter != outlets_.end(); outletIter++) {
-    if (outletIter->name() == name) {
-      return &(*outletIter);
-    }
+  auto found = outletIndex_.find(name);
+  if (found == outletIndex_.end()) {
+    return nullptr;
   }
-  return nullptr;
+  return &outlets_[found->second];
 }
 
 bool WebPowerSwitch::on(absl::string_view outletName) {
@@ -481,13 +630,188 @@ bool WebPowerSwitch::toggle(absl::string_view outletName) {
   return setState(ol, ol->state() == OUTLET_STATE_ON ? OUTLET_STATE_OFF : OUTLET_STATE_ON);
 }
 
-bool WebPowerSwitch::setState(const Outlet* outlet, OutletState newState) {
+bool WebPowerSwitch::setStates(const std::vector<std::pair<std::string, OutletState>>& states) {
+  std::vector<std::pair<int, OutletState>> byId;
+  if (outletIds(states, byId) == false) {
+    return false;
+  }
+  return setStates(byId);
+}
+
+bool WebPowerSwitch::setStates(const std::vector<std::pair<int, OutletState>>& states) {
+  std::vector<std::pair<size_t, OutletState>> changes;
+  bool allOutlets;
+  if (planStates(states, changes, allOutlets) == false) {
+    return false;
+  }
+  if (changes.empty()) {
+    return true;
+  }
+
+  bool success = true;
+  CURL* request = pool_->acquire();
+  if (allOutlets) {
+    success = requestOutlet(request, "a", changes[0].second);
+  } else {
+    for (const auto& [index, newState] : changes) {
+      if (requestOutlet(request, absl::StrCat(outlets_[index].id()), newState) == false) {
+        success = false;
+        break;
+      }
+    }
+  }
+  pool_->release(request);
+
+  if (optimistic_ && success) {
+    assumeStates(changes);
+    return true;
+  }
+  buildOutlets();
+  return success;
+}
+
+Task<bool> WebPowerSwitch::setStatesAsync(EventLoop& loop,
+                                          std::vector<std::pair<std::string, OutletState>> states) {
+  std::vector<std::pair<int, OutletState>> byId;
+  if (outletIds(states, byId) == false) {
+    co_return false;
+  }
+  co_return co_await setStatesAsync(loop, std::move(byId));
+}
+
+Task<bool> WebPowerSwitch::setStatesAsync(EventLoop& loop,
+                                          std::vector<std::pair<int, OutletState>> states) {
+  std::vector<std::pair<size_t, OutletState>> changes;
+  bool allOutlets;
+  if (planStates(states, changes, allOutlets) == false) {
+    co_return false;
+  }
+  if (changes.empty()) {
+    co_return true;
+  }
+
+  bool success = true;
+  CURL* request = pool_->acquire();
+  // co_await is kept out of && and ||: GCC 12 fails to compile it there.
+  if (allOutlets) {
+    success = prepOutletRequest(request, "a", changes[0].second);
+    if (success) {
+      auto result = co_await loop.perform(request);
+      success = outletRequestSucceeded(request, result);
+    }
+  } else {
+    for (const auto& [index, newState] : changes) {
+      success = prepOutletRequest(request, absl::StrCat(outlets_[index].id()), newState);
+      if (success) {
+        auto result = co_await loop.perform(request);
+        success = outletRequestSucceeded(request, result);
+      }
+      if (success == false) {
+        break;
+      }
+    }
+  }
+  pool_->release(request);
+
+  if (optimistic_ && success) {
+    assumeStates(changes);
+    co_return true;
+  }
+  co_await refreshAsync(loop);
+  co_return success;
+}
+
+bool WebPowerSwitch::outletIds(const std::vector<std::pair<std::string, OutletState>>& states,
+                               std::vector<std::pair<int, OutletState>>& byId) {
+  for (const auto& [name, newState] : states) {
+    auto ol = getOutlet(name);
+    if (ol == nullptr) {
+      std::cerr << "unknown outlet: " << name << std::endl;
+      return false;
+    }
+    byId.push_back({ol->id(), newState});
+  }
+  return true;
+}
+
+bool WebPowerSwitch::planStates(const std::vector<std::pair<int, OutletState>>& states,
+                                std::vector<std::pair<size_t, OutletState>>& changes,
+                                bool& allOutlets) {
   if (loggedIn_ == false) {
     std::cerr << "not logged in" << std::endl;
     return false;
   }
+
+  // One target per outlet: the last one asked for wins.
+  std::vector<std::pair<size_t, OutletState>> targets;
+  for (const auto& [id, newState] : states) {
+    auto iter = std::find_if(outlets_.begin(), outlets_.end(),
+                             [id](const Outlet& outlet) { return outlet.id() == id; });
+    if (iter == outlets_.end()) {
+      std::cerr << "unknown outlet id: " << id << std::endl;
+      return false;
+    }
+    if (newState == OUTLET_STATE_UNKNOWN) {
+      std::cerr << "unknown new state" << std::endl;
+      return false;
+    }
+    size_t index = iter - outlets_.begin();
+    auto seen = std::find_if(targets.begin(), targets.end(),
+                             [index](const auto& target) { return target.first == index; });
+    if (seen != targets.end()) {
+      seen->second = newState;
+    } else {
+      targets.push_back({index, newState});
+    }
+  }
+
+  // Only outlets not already in their target state need a command.
+  for (const auto& [index, newState] : targets) {
+    if (outlets_[index].state() != newState) {
+      changes.push_back({index, newState});
+    }
+  }
+  if (changes.empty()) {
+    allOutlets = false;
+    return true;
+  }
+
+  // When every outlet ends up in the same state, the firmware's "a" (all)
+  // request does it at once; otherwise the commands go out back to back on
+  // one handle (one kept-alive connection).
+  auto target = changes[0].second;
+  bool allSame = std::all_of(changes.begin(), changes.end(),
+                             [target](const auto& change) { return change.second == target; });
+  allOutlets = allSame && changes.size() > 1 &&
+      static_cast<size_t>(std::count_if(outlets_.begin(), outlets_.end(),
+          [target](const Outlet& outlet) { return outlet.state() != target; })) == changes.size();
+  return true;
+}
+
+void WebPowerSwitch::assumeStates(const std::vector<std::pair<size_t, OutletState>>& changes) {
+  // Assume the switch did as told; verify() re-reads the page on demand.
+  for (const auto& [index, newState] : changes) {
+    auto& target = outlets_[index];
+    target = Outlet(target.id(), target.name(), newState);
+    assumedOutlets_.emplace_back(target.name());
+  }
+  outletsVerified_ = false;
+}
+
+bool WebPowerSwitch::setState(const Outlet* outlet, OutletState newState) {
+  return setStates(std::vector<std::pair<int, OutletState>>{{outlet->id(), newState}});
+}
+
+bool WebPowerSwitch::requestOutlet(CURL* request, absl::string_view outlet, OutletState newState) {
+  if (prepOutletRequest(request, outlet, newState) == false) {
+    return false;
+  }
+  return outletRequestSucceeded(request, curl_easy_perform(request));
+}
+
+bool WebPowerSwitch::prepOutletRequest(CURL* request, absl::string_view outlet, OutletState newState) {
   std::ostringstream ostrUrl;
-  ostrUrl << prefix_ << host() << "/outlet?" << outlet->id() << "=";
+  ostrUrl << prefix_ << host() << "/outlet?" << outlet << "=";
   switch (newState) {
   case OUTLET_STATE_ON:
     ostrUrl << "ON";
@@ -500,23 +824,21 @@ bool WebPowerSwitch::setState(const Outlet* outlet, OutletState newState) {
     return false;
   }
 
-  CURL* request;
-  request = curl_easy_init();
-  
   curl_easy_setopt(request, CURLOPT_URL, ostrUrl.str().c_str());
-  curl_easy_setopt(request, CURLOPT_SHARE, share_);
   curl_easy_setopt(request, CURLOPT_COOKIEFILE, "");
   curl_easy_setopt(request, CURLOPT_TIMEOUT, CURL_TIMEOUT);
   if (verbose_ > 2) {
     curl_easy_setopt(request, CURLOPT_VERBOSE, 1L);
   }
 
-  std::ostringstream os;
-  curl_easy_setopt(request, CURLOPT_WRITEFUNCTION, writeFunctionStream);
-  curl_easy_setopt(request, CURLOPT_WRITEDATA, &os);
-
-  auto result = curl_easy_perform(request);
+  response_.clear();
+  curl_easy_setopt(request, CURLOPT_WRITEFUNCTION, writeFunctionBuffer);
+  curl_easy_setopt(request, CURLOPT_WRITEDATA, &response_);
+  return true;
+}
 
-  buildOutlets();
-  return result == CURLE_OK;
+bool WebPowerSwitch::outletRequestSucceeded(CURL* request, CURLcode result) {
+  long responseCode = 0;
+  curl_easy_getinfo(request, CURLINFO_RESPONSE_CODE, &responseCode);
+  return result == CURLE_OK && responseCode < 400;
 }
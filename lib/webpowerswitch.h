@@ -4,8 +4,15 @@
 #include <absl/strings/string_view.h>
 #include <curl/curl.h>
 #include <iomanip>
+#include <memory>
+#include <string>
 #include <vector>
 
+#include "connectionpool.h"
+#include "eventloop.h"
+#include "stringhash.h"
+
+class OutletPageParser;
 
 enum OutletState {
   OUTLET_STATE_OFF = 0,
@@ -46,22 +53,39 @@ private:
   }
 };
 
+struct UsernamePassword {
+  std::string username;
+  std::string password;
+};
+
 class WebPowerSwitch {
 public:
-  WebPowerSwitch(absl::string_view host);
+  // Requests go through pool (shared connections, DNS and cookies) when
+  // given; otherwise the switch keeps a pool of its own.
+  WebPowerSwitch(absl::string_view host, ConnectionPool* pool = nullptr);
   WebPowerSwitch(const WebPowerSwitch&) = delete;
   virtual ~WebPowerSwitch();
   void suppressDetectionErrors() {
     suppressDetectionErrors_ = true;
   }
   bool login(absl::string_view username, absl::string_view password);
+  bool login(const std::vector<UsernamePassword>& credentials);
   CURL* startLogin(absl::string_view username, absl::string_view password);
+  // The login page is fetched once; each credential is then tried in turn
+  // against its challenge until one logs in.
+  CURL* startLogin(const std::vector<UsernamePassword>& credentials);
   CURL* next();
+  // Log in with cookies saved from an earlier session; false if expired.
+  bool resume(const std::vector<std::string>& cookies);
+  // Cookies (Netscape cookie file lines) of the current session.
+  std::vector<std::string> sessionCookies();
   void logout();
   bool isLoggedIn() const {
     return loggedIn_;
   }
   void dumpOutlets(std::ostream& ostr);
+  // Same layout, for outlets not read from a switch just now.
+  static void dumpOutlets(std::ostream& ostr, absl::string_view name, const std::vector<Outlet>& outlets);
   absl::string_view host() const {
     return host_;
   }
@@ -81,9 +105,41 @@ public:
   bool on(absl::string_view outletName);
   bool off(absl::string_view outletName);
   bool toggle(absl::string_view outletName);
+  // Set many outlets (by name or by id) with a single refresh at the end.
+  bool setStates(const std::vector<std::pair<std::string, OutletState>>& states);
+  bool setStates(const std::vector<std::pair<int, OutletState>>& states);
   void verbose(int increment = 1) {
     verbose_ += increment;
   }
+  // In optimistic mode a successful on/off/toggle updates outlets() in
+  // place instead of re-reading /index.htm after every command.
+  void optimistic(bool optimistic = true) {
+    optimistic_ = optimistic;
+  }
+  // Re-read outlet states from the switch.
+  bool refresh();
+  // refresh(), but only if optimistic updates were made since the last read.
+  bool verify();
+  // when outlets() were last read from the switch; 0 for never
+  time_t outletsRead() const {
+    return outletsRead_;
+  }
+  // false while outlets() holds states assumed by optimistic commands
+  bool outletsVerified() const {
+    return outletsVerified_;
+  }
+  // names of the outlets whose states were assumed since the last read
+  const std::vector<std::string>& assumedOutlets() const {
+    return assumedOutlets_;
+  }
+
+  // The same, as coroutines whose requests run on loop alongside any
+  // others there.  One operation at a time per switch.
+  Task<bool> loginAsync(EventLoop& loop, std::vector<UsernamePassword> credentials);
+  Task<bool> resumeAsync(EventLoop& loop, std::vector<std::string> cookies);
+  Task<bool> refreshAsync(EventLoop& loop);
+  Task<bool> setStatesAsync(EventLoop& loop, std::vector<std::pair<std::string, OutletState>> states);
+  Task<bool> setStatesAsync(EventLoop& loop, std::vector<std::pair<int, OutletState>> states);
 
 private:
   enum State {
@@ -98,24 +154,60 @@ private:
   std::string prefix_ = {"http://"};
   std::string host_;
   CURL* request_ = nullptr;
-  std::ostringstream os_;
-  std::string username_;
-  std::string password_;
+  // Body of the request in flight; cleared, never shrunk, between requests.
+  std::string response_;
+  std::vector<UsernamePassword> credentials_;
+  size_t credential_ = 0;
+  std::string challenge_;
+  // Hex MD5 answers to challenge_, one per credential.
+  std::vector<std::string> responses_;
+  std::string loginAction_;
   bool loggedIn_ = false;
-  CURLSH* share_ = nullptr;
+  std::unique_ptr<ConnectionPool> ownPool_;
+  ConnectionPool* pool_ = nullptr;
   std::string name_ = {};
   std::vector<Outlet> outlets_;
+  // outlet name to its position in outlets_ (first of duplicate names)
+  StringMap<size_t> outletIndex_;
+  std::unique_ptr<OutletPageParser> outletParser_;
   bool suppressDetectionErrors_ = false;
   static const long CURL_TIMEOUT;
   int verbose_ { 0 };
   time_t nextBuild_ = 0;
+  bool optimistic_ = false;
+  bool outletsVerified_ = true;
+  std::vector<std::string> assumedOutlets_;
+  time_t outletsRead_ = 0;
 
+  absl::string_view response() const {
+    return response_;
+  }
   void initializeRequest();
+  bool parseLoginPage();
+  // parseLoginPage on a failed login's reply, keeping the old challenge if
+  // the reply is not a login page.
+  void retryChallenge();
+  void prepLoginRequest();
   void clearRequest();
 	void dumpCookies();
   void prepToFetchOutlets();
+  // curl write function for the outlet page: feeds outletParser_.
+  static size_t writeFunctionParser(char* ptr, size_t size, size_t nmemb,
+                                    WebPowerSwitch* wps);
   void buildOutlets();
+  void indexOutlets();
   bool setState(const Outlet* outlet, OutletState newState);
+  void addCookies(const std::vector<std::string>& cookies);
+  bool outletIds(const std::vector<std::pair<std::string, OutletState>>& states,
+                 std::vector<std::pair<int, OutletState>>& byId);
+  // Outlets (by position) that need a command; allOutlets when one "a"
+  // request does them all.
+  bool planStates(const std::vector<std::pair<int, OutletState>>& states,
+                  std::vector<std::pair<size_t, OutletState>>& changes, bool& allOutlets);
+  void assumeStates(const std::vector<std::pair<size_t, OutletState>>& changes);
+  bool requestOutlet(CURL* request, absl::string_view outlet, OutletState newState);
+  bool prepOutletRequest(CURL* request, absl::string_view outlet, OutletState newState);
+  bool outletRequestSucceeded(CURL* request, CURLcode result);
   bool detectionErrorsAreSuppressed() {
     return suppressDetectionErrors_ && verbose_ == 0;
   }
@@ -1,31 +1,34 @@
 #include "webpowerswitchmanager.h"
 
 #include <absl/strings/str_cat.h>
+#include <algorithm>
 #include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
 #include <cstring>
 #include <dirent.h>
 #include <fstream>
 #include <ifaddrs.h>
 #include <iostream>
 #include <netdb.h>
+#include <optional>
+#include <sstream>
 #include <sys/file.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#include "switchdiscovery.h"
 
-const char* WebPowerSwitchManager::CACHE_KEY_CONTROLLERBYNAME = "controller_by_name";
-const char* WebPowerSwitchManager::CACHE_CONTROLLERBYNAME_KEY_HOST = "host";
-const char* WebPowerSwitchManager::CACHE_KEY_OUTLETS = "outlets";
-const char* WebPowerSwitchManager::CACHE_OUTLETS_KEY_CONTROLLER = "controller";
-const char* WebPowerSwitchManager::CACHE_OUTLETS_KEY_ID = "id";
+
+const char* WebPowerSwitchManager::SESSION_KEY_EXPIRES = "expires";
+const char* WebPowerSwitchManager::SESSION_KEY_COOKIES = "cookies";
 
 WebPowerSwitchManager::WebPowerSwitchManager(bool enableCache, bool findSwitches)
 : enableCache_(enableCache), findSwitches_(findSwitches) {
 }
 
-WebPowerSwitchManager::~WebPowerSwitchManager() {
-}
-
 bool WebPowerSwitchManager::addUsernamePassword(absl::string_view username, absl::string_view password) {
   vUsernamePassword_.push_back({std::string(username), std::string(password)});
   return true;
@@ -38,22 +41,119 @@ bool WebPowerSwitchManager::load() {
 
   loadCache();
   if (isCacheLoaded() == false) {
-    writeCacheStart();
-    findSwitches();
-    writeCacheFinish();
+    discover();
   }
 
   return true;
 }
 
-void WebPowerSwitchManager::resetCache() {
-  if (isCacheLoaded()) {
-    cache_.reset();
+void WebPowerSwitchManager::discover() {
+  // Single flight: one process finds switches, the others wait and load
+  // what it publishes.  Anything published since this process loaded
+  // counts, whether or not it had to wait; after a reset, only what is
+  // published from now on.
+  if (replaceCache_) {
+    cacheGeneration_ = std::max(cacheGeneration_, publishedGeneration());
+  }
+  auto lockFd = lockDiscovery();
+  if (loadNewerCache() && isCacheLoaded()) {
+    if (verbose_) {
+      std::cout << "discovery: loading result of another process" << std::endl;
+    }
+    if (lockFd >= 0) {
+      close(lockFd);
+    }
+    return;
+  }
+
+  writeCacheStart();
+  findSwitches(&pool_);
+  writeCacheFinish();
+  if (lockFd >= 0) {
+    close(lockFd);
+  }
+}
+
+int WebPowerSwitchManager::lockDiscovery() {
+  if (enableCache_ == false || validateCacheFile() == false) {
+    return -1;
+  }
+  auto fd = open(discoveryLockFile_.c_str(), O_CREAT | O_RDWR, 0666);
+  if (fd < 0) {
+    return -1;
+  }
+  auto deadline = time(nullptr) + discoveryWaitTimeout_;
+  bool waited = false;
+  while (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+    if (errno != EWOULDBLOCK) {
+      std::cerr << "ERROR: failed to obtain discovery lock: " << discoveryLockFile_
+                << " (" << errno << ": " << strerror(errno) << ")" << std::endl;
+      close(fd);
+      return -1;
+    }
+    if (time(nullptr) >= deadline) {
+      std::cerr << "WARNING: gave up waiting for discovery by another process" << std::endl;
+      close(fd);
+      return -1;
+    }
+    if (waited == false && verbose_) {
+      std::cout << "discovery: waiting for another process" << std::endl;
+    }
+    waited = true;
+    usleep(100 * 1000);
+  }
+  return fd;
+}
+
+bool WebPowerSwitchManager::loadNewerCache() {
+  if (enableCache_ == false || validateCacheFile() == false) {
+    return false;
+  }
+  auto fd = open(cacheFile_.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  bool loaded = SwitchCache::generation(fd) > cacheGeneration_ && cache_.map(fd);
+  if (loaded) {
+    cacheGeneration_ = cache_.generation();
+    replaceCache_ = false;
+  }
+  close(fd);
+  return loaded;
+}
+
+uint64_t WebPowerSwitchManager::publishedGeneration() {
+  if (enableCache_ == false || validateCacheFile() == false) {
+    return 0;
+  }
+  auto fd = open(cacheFile_.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return 0;
+  }
+  auto generation = SwitchCache::generation(fd);
+  close(fd);
+  return generation;
+}
+
+bool WebPowerSwitchManager::addSubnet(absl::string_view subnet) {
+  if (subnet.find('/') != absl::string_view::npos) {
+    unsigned long firstIp;
+    unsigned long lastIp;
+    if (getSubnetRange(subnet, firstIp, lastIp) == false) {
+      return false;
+    }
   }
+  subnets_.emplace_back(subnet);
+  return true;
+}
+
+void WebPowerSwitchManager::resetCache() {
+  cache_.clear();
   resetCache_ = true;
+  replaceCache_ = true;
 }
 
-WebPowerSwitch* WebPowerSwitchManager::getSwitch(std::string name, bool allow_miss) {
+WebPowerSwitch* WebPowerSwitchManager::getSwitch(absl::string_view name, bool allow_miss) {
   if (verbose_ > 2) {
     std::cerr << "DEBUG: WebPowerSwitchManager::getSwitch(" << name << ", "
               << allow_miss << ") called" << std::endl;
@@ -65,19 +165,23 @@ WebPowerSwitch* WebPowerSwitchManager::getSwitch(std::string name, bool allow_mi
     return nullptr;
   }
   auto iter = mNameToSwitch_.find(name);
-  if (iter != mNameToSwitch_.end()) {
+  if (iter != mNameToSwitch_.end() && recheck(iter->second.get())) {
     return iter->second.get();
   }
-  if (!cache_[CACHE_KEY_CONTROLLERBYNAME][name]) {
+  absl::string_view host;
+  time_t verified;
+  if (!cache_.findController(name, host, &verified)) {
     if (allow_miss == false) {
       std::cerr << "ERROR: unknown switch name: " << name << std::endl;
     }
     return nullptr;
   }
-  return connectSwitch(cache_[CACHE_KEY_CONTROLLERBYNAME][name][CACHE_CONTROLLERBYNAME_KEY_HOST].as<std::string>());
+  noteVerified(name, verified);
+  // copied: connecting rewrites the cache
+  return connectSwitch(std::string(host));
 }
 
-WebPowerSwitch* WebPowerSwitchManager::getSwitchByIp(std::string ip, bool allow_miss) {
+WebPowerSwitch* WebPowerSwitchManager::getSwitchByIp(absl::string_view ip, bool allow_miss) {
   if (verbose_ > 2) {
     std::cerr << "DEBUG: WebPowerSwitchManager::getSwitchByIp(" << ip << ", "
               << allow_miss << ") called" << std::endl;
@@ -89,38 +193,44 @@ WebPowerSwitch* WebPowerSwitchManager::getSwitchByIp(std::string ip, bool allow_
     return nullptr;
   }
 
+  auto live = hostToSwitch_.find(ip);
+  if (live != hostToSwitch_.end() && recheck(live->second)) {
+    return live->second;
+  }
+
   // Search cache
-  if (cache_[CACHE_KEY_CONTROLLERBYNAME]) {
-    for (auto controller : cache_[CACHE_KEY_CONTROLLERBYNAME]) {
-      if (verbose_ > 1) {
-        std::cerr << "DEBUG: controller name: "
-                  << controller.first.as<std::string>() << " host: "
-                  << controller.second[CACHE_CONTROLLERBYNAME_KEY_HOST]
-                         .as<std::string>()
-                  << std::endl;
-      }
-      if (controller.second[CACHE_CONTROLLERBYNAME_KEY_HOST].as<std::string>() == ip) {
-        return getSwitch(controller.first.as<std::string>(), allow_miss);
-      }
+  absl::string_view name;
+  if (cache_.findControllerByHost(ip, name)) {
+    if (verbose_ > 1) {
+      std::cerr << "DEBUG: controller name: " << name << " host: " << ip << std::endl;
     }
+    return getSwitch(std::string(name), allow_miss);
   }
 
   // Open based on IP
   return connectSwitch(ip);
 }
 
-WebPowerSwitch* WebPowerSwitchManager::getSwitchByOutletName(std::string name) {
+WebPowerSwitch* WebPowerSwitchManager::getSwitchByOutletName(absl::string_view name) {
   if (load() == false) {
     return nullptr;
   }
-  if (!cache_[CACHE_KEY_OUTLETS] || !cache_[CACHE_KEY_OUTLETS][name]) {
+  auto live = outletToSwitch_.find(name);
+  if (live != outletToSwitch_.end() && recheck(live->second)) {
+    return live->second;
+  }
+  absl::string_view controller;
+  int id;
+  time_t verified;
+  if (!cache_.findOutlet(name, controller, id, &verified)) {
     //std::cout << "unknown outlet name: " << name << std::endl;
     return nullptr;
   }
-  return getSwitch(cache_[CACHE_KEY_OUTLETS][name][CACHE_OUTLETS_KEY_CONTROLLER].as<std::string>());
+  noteVerified(controller, verified);
+  return getSwitch(std::string(controller));
 }
 
-Outlet* WebPowerSwitchManager::getOutletByName(std::string name) {
+Outlet* WebPowerSwitchManager::getOutletByName(absl::string_view name) {
   auto wps = getSwitchByOutletName(name);
   if (wps == nullptr) {
     return nullptr;
@@ -128,7 +238,7 @@ Outlet* WebPowerSwitchManager::getOutletByName(std::string name) {
   return wps->getOutlet(name);
 }
 
-void WebPowerSwitchManager::dumpSwitches(std::ostream& ostr) {
+void WebPowerSwitchManager::dumpSwitches(std::ostream& ostr, time_t maxAge) {
   if (verbose_ > 2) {
     std::cerr << "DEBUG: WebPowerSwitchManager::dumpSwitches called" << std::endl;
   }
@@ -136,17 +246,309 @@ void WebPowerSwitchManager::dumpSwitches(std::ostream& ostr) {
     std::cerr << "no switches found or able to load" << std::endl;
     return;
   }
-  auto cbnCache = cache_[CACHE_KEY_CONTROLLERBYNAME];
-  for (auto controller : cbnCache) {
-    auto wps = getSwitch(controller.first.as<std::string>());
+  // Every switch is logged in to (or re-read) at once on loop_, so this
+  // takes as long as the slowest one; output stays in name order.
+  auto controllers = cache_.controllers();
+  std::vector<std::optional<std::string>> cached(controllers.size());
+  std::vector<Task<WebPowerSwitch*>> pending;
+  // Switches connected meanwhile are published in one write at the end.
+  deferPublish_ = true;
+  for (size_t i = 0; i < controllers.size(); ++i) {
+    std::ostringstream fresh;
+    if (maxAge > 0 && dumpCachedOutlets(controllers[i].name, fresh, time(nullptr) - maxAge)) {
+      cached[i] = fresh.str();
+      continue;
+    }
+    pending.push_back(getSwitchAsync(controllers[i].name));
+    loop_.start(pending.back());
+  }
+  loop_.run();
+  deferPublish_ = false;
+  publishAdopted();
+
+  auto task = pending.begin();
+  for (size_t i = 0; i < controllers.size(); ++i) {
+    if (cached[i]) {
+      ostr << *cached[i];
+      continue;
+    }
+    auto wps = (task++)->result();
     if (wps != nullptr) {
       wps->dumpOutlets(ostr);
     }
   }
 }
 
+bool WebPowerSwitchManager::showCached(absl::string_view target, std::ostream& ostr, time_t maxAge) {
+  if (load() == false) {
+    return false;
+  }
+  auto oldest = time(nullptr) - maxAge;
+  absl::string_view host;
+  if (cache_.findController(target, host)) {
+    return dumpCachedOutlets(target, ostr, oldest);
+  }
+  absl::string_view name;
+  if (cache_.findControllerByHost(target, name)) {
+    return dumpCachedOutlets(name, ostr, oldest);
+  }
+  absl::string_view controller;
+  int id;
+  time_t verified;
+  int state;
+  if (cache_.findOutlet(target, controller, id, &verified, &state) == false ||
+      verified < oldest || state == OUTLET_STATE_UNKNOWN) {
+    return false;
+  }
+  ostr << controller << ": " << Outlet(id, target, static_cast<OutletState>(state)) << std::endl;
+  return true;
+}
+
+void WebPowerSwitchManager::recordOutletStates(WebPowerSwitch* wps) {
+  if (wps->outletsVerified() == false) {
+    forgetOutletStates(wps);
+    return;
+  }
+  writeCacheStart();
+  cacheOutlets(wps);
+  writeCacheFinish();
+}
+
+void WebPowerSwitchManager::forgetOutletStates(WebPowerSwitch* wps) {
+  // Cached states carry the time they were read and an assumed one was
+  // not, so the outlets commanded are left with no state at all.
+  const auto& assumed = wps->assumedOutlets();
+  auto outlets = cache_.outlets(wps->name());
+  bool changed = false;
+  for (auto& outlet : outlets) {
+    if (outlet.state != OUTLET_STATE_UNKNOWN &&
+        std::find(assumed.begin(), assumed.end(), outlet.name) != assumed.end()) {
+      outlet.state = OUTLET_STATE_UNKNOWN;
+      changed = true;
+    }
+  }
+  if (changed) {
+    writeCacheStart();
+    cache_.replaceOutlets(wps->name(), outlets);
+    writeCacheFinish();
+  }
+}
+
+void WebPowerSwitchManager::recheckSwitches(time_t maxAge) {
+  auto now = time(nullptr);
+  for (const auto& entry : mNameToSwitch_) {
+    if (now - entry.second->outletsRead() >= maxAge) {
+      recheck_.insert(entry.second.get());
+    }
+  }
+}
+
+bool WebPowerSwitchManager::recheck(WebPowerSwitch* wps) {
+  if (recheck_.erase(wps) == 0) {
+    return true;
+  }
+  // outlets may have been renamed meanwhile
+  unindexSwitch(wps);
+  if (wps->refresh()) {
+    indexSwitch(wps);
+    return true;
+  }
+  if (verbose_ > 1) {
+    std::cout << "reconnecting: " << wps->host() << std::endl;
+  }
+  dropSwitch(wps);
+  return false;
+}
+
+Task<bool> WebPowerSwitchManager::recheckAsync(WebPowerSwitch* wps) {
+  if (recheck_.erase(wps) == 0) {
+    co_return true;
+  }
+  unindexSwitch(wps);
+  if (co_await wps->refreshAsync(loop_)) {
+    indexSwitch(wps);
+    co_return true;
+  }
+  if (verbose_ > 1) {
+    std::cout << "reconnecting: " << wps->host() << std::endl;
+  }
+  dropSwitch(wps);
+  co_return false;
+}
+
+void WebPowerSwitchManager::dropSwitch(WebPowerSwitch* wps) {
+  recheck_.erase(wps);
+  unindexSwitch(wps);
+  // by pointer: a switch that failed may no longer report its name
+  auto found = std::find_if(mNameToSwitch_.begin(), mNameToSwitch_.end(),
+                            [wps](const auto& entry) { return entry.second.get() == wps; });
+  if (found != mNameToSwitch_.end()) {
+    mNameToSwitch_.erase(found);
+  }
+}
+
+Task<WebPowerSwitch*> WebPowerSwitchManager::getSwitchAsync(std::string name) {
+  if (load() == false) {
+    co_return nullptr;
+  }
+  auto iter = mNameToSwitch_.find(name);
+  if (iter != mNameToSwitch_.end()) {
+    auto wps = iter->second.get();
+    if (co_await recheckAsync(wps)) {
+      co_return wps;
+    }
+  }
+  absl::string_view host;
+  time_t verified;
+  if (!cache_.findController(name, host, &verified)) {
+    std::cerr << "ERROR: unknown switch name: " << name << std::endl;
+    co_return nullptr;
+  }
+  noteVerified(name, verified);
+  co_return co_await connectSwitchAsync(std::string(host));
+}
+
+Task<bool> WebPowerSwitchManager::refreshSwitchAsync(std::string name) {
+  // Connecting, or a pending recheck, reads the outlets already.
+  auto known = mNameToSwitch_.find(name);
+  auto before = known == mNameToSwitch_.end() ? nullptr : known->second.get();
+  bool readAnyway = before == nullptr || recheck_.contains(before);
+  auto wps = co_await getSwitchAsync(name);
+  if (wps == nullptr) {
+    co_return false;
+  }
+  if (wps == before && !readAnyway) {
+    unindexSwitch(wps);
+    auto refreshed = co_await wps->refreshAsync(loop_);
+    indexSwitch(wps);
+    if (refreshed == false) {
+      co_return false;
+    }
+    recordOutletStates(wps);
+  }
+  co_return true;
+}
+
+Task<bool> WebPowerSwitchManager::setOutletAsync(std::string outletName, OutletState state) {
+  if (load() == false) {
+    co_return false;
+  }
+  WebPowerSwitch* wps = nullptr;
+  auto live = outletToSwitch_.find(outletName);
+  if (live != outletToSwitch_.end()) {
+    wps = live->second;
+    if (co_await recheckAsync(wps) == false) {
+      wps = nullptr;
+    }
+  }
+  if (wps == nullptr) {
+    absl::string_view controller;
+    int id;
+    time_t verified;
+    if (!cache_.findOutlet(outletName, controller, id, &verified)) {
+      std::cerr << "unknown outlet: " << outletName << std::endl;
+      co_return false;
+    }
+    noteVerified(controller, verified);
+    wps = co_await getSwitchAsync(std::string(controller));
+  }
+  if (wps == nullptr) {
+    co_return false;
+  }
+  std::vector<std::pair<std::string, OutletState>> states;
+  states.emplace_back(outletName, state);
+  auto done = co_await wps->setStatesAsync(loop_, std::move(states));
+  if (done) {
+    recordOutletStates(wps);
+  }
+  co_return done;
+}
+
+bool WebPowerSwitchManager::dumpCachedOutlets(absl::string_view controller, std::ostream& ostr,
+                                              time_t oldest) {
+  std::vector<Outlet> outlets;
+  for (const auto& outlet : cache_.outlets(controller)) {
+    if (outlet.verified < oldest || outlet.state == OUTLET_STATE_UNKNOWN) {
+      return false;
+    }
+    outlets.emplace_back(outlet.id, outlet.name, static_cast<OutletState>(outlet.state));
+  }
+  if (outlets.empty()) {
+    return false;
+  }
+  if (verbose_ > 1) {
+    std::cout << "cached: " << controller << std::endl;
+  }
+  WebPowerSwitch::dumpOutlets(ostr, controller, outlets);
+  return true;
+}
+
+void WebPowerSwitchManager::revalidateInBackground() {
+  if (staleControllers_.empty() || enableCache_ == false || validateCacheFile() == false) {
+    return;
+  }
+  // Twice, so that the worker is not left for this process to reap.
+  auto child = fork();
+  if (child < 0) {
+    std::cerr << "ERROR: fork failed: " << errno << ": " << strerror(errno) << std::endl;
+    return;
+  }
+  if (child > 0) {
+    staleControllers_.clear();
+    waitpid(child, nullptr, 0);
+    return;
+  }
+  if (fork() != 0) {
+    _exit(0);
+  }
+  setsid();
+  // Output would hold a reader of ours (a pipe) open until it finished.
+  auto devNull = open("/dev/null", O_RDWR);
+  if (devNull >= 0) {
+    dup2(devNull, STDIN_FILENO);
+    dup2(devNull, STDOUT_FILENO);
+    dup2(devNull, STDERR_FILENO);
+  }
+  // The switches are bound to the parent's connections; they are dropped
+  // unused and the check gets connections of its own.
+  for (auto& entry : mNameToSwitch_) {
+    entry.second.release();
+  }
+  mNameToSwitch_.clear();
+  hostToSwitch_.clear();
+  outletToSwitch_.clear();
+  ConnectionPool pool;
+  writeCacheStart();
+  revalidateCache(&pool);
+  writeCacheFinish();
+  _exit(0);
+}
+
+bool WebPowerSwitchManager::exportCache(std::ostream& ostr) {
+  if (load() == false) {
+    return false;
+  }
+  ostr << cache_.exportYaml() << std::endl;
+  return true;
+}
+
+bool WebPowerSwitchManager::importCache(absl::string_view yamlFile) {
+  SwitchCache imported;
+  try {
+    imported.importYaml(YAML::LoadFile(std::string(yamlFile)));
+  } catch (...) {
+    std::cerr << "ERROR: failed to import cache: " << yamlFile << std::endl;
+    return false;
+  }
+  cache_ = std::move(imported);
+  replaceCache_ = true;
+  writeCacheStart();
+  writeCacheFinish();
+  return true;
+}
+
 bool WebPowerSwitchManager::isCacheLoaded() {
-  return (cache_.size() > 0);
+  return !cache_.empty();
 }
 
 bool WebPowerSwitchManager::validateCacheFile() {
@@ -160,7 +562,8 @@ bool WebPowerSwitchManager::validateCacheFile() {
     if (errno == ENOENT) {
       // TODO: check return value
       mkdir(cacheDirectory.c_str(), 0777);
-      chmod(cacheDirectory.c_str(), 0777);
+      // shared, but sticky: files are only removed or renamed by their owners
+      chmod(cacheDirectory.c_str(), 01777);
     } else {
       std::cout << "unable to create cache directory: " << cacheDirectory << std::endl;
       return false;
@@ -168,7 +571,33 @@ bool WebPowerSwitchManager::validateCacheFile() {
   } else {
     closedir(dir);
   }
-  cacheFile_ = cacheDirectory + "cache.yaml";
+  cacheFile_ = cacheDirectory + "cache.bin";
+  yamlCacheFile_ = cacheDirectory + "cache.yaml";
+  cacheLockFile_ = cacheDirectory + "cache.lock";
+  discoveryLockFile_ = cacheDirectory + "discovery.lock";
+  sessionDirectory_ = absl::StrCat(cacheDirectory, "sessions-", getuid(), "/");
+  sessionFile_ = sessionDirectory_ + "sessions.yaml";
+  sessionLockFile_ = sessionDirectory_ + "sessions.lock";
+  return true;
+}
+
+bool WebPowerSwitchManager::validateSessionDirectory() {
+  if (enableCache_ == false || validateCacheFile() == false) {
+    return false;
+  }
+  // Session cookies are as good as a password: the directory is private,
+  // and one that is not ours (or is a link to somewhere) is not used.
+  if (mkdir(sessionDirectory_.c_str(), 0700) != 0 && errno != EEXIST) {
+    std::cerr << "ERROR: failed to create session directory: " << sessionDirectory_
+              << " (" << errno << ": " << strerror(errno) << ")" << std::endl;
+    return false;
+  }
+  struct stat statDirectory;
+  if (lstat(sessionDirectory_.c_str(), &statDirectory) != 0 || !S_ISDIR(statDirectory.st_mode) ||
+      statDirectory.st_uid != getuid() || (statDirectory.st_mode & 077) != 0) {
+    std::cerr << "ERROR: session directory is not private: " << sessionDirectory_ << std::endl;
+    return false;
+  }
   return true;
 }
 
@@ -199,47 +628,48 @@ void WebPowerSwitchManager::loadCache() {
       std::cerr << "DEBUG: cache file does not exist (or is not readable): "
                 << cacheFile_ << std::endl;
     }
-    return;
-  }
-  auto tooOld = time(nullptr) - cacheTimeout_;
-  if (statCacheFile.st_mtime <= tooOld) {
-    if (verbose_ > 2) {
-      std::cerr << "DEBUG: cache file is too old : " << cacheFile_ << std::endl;
+    // carry over a cache from before the binary format
+    if (importYamlCache()) {
+      writeCacheStart();
+      writeCacheFinish();
     }
     return;
   }
-
+  // No lock: the file is only ever replaced whole, never rewritten in place.
   auto fd = open(cacheFile_.c_str(), O_RDONLY);
   if (fd < 0) {
     std::cerr << "ERROR: failed to open cache: " << cacheFile_ << std::endl;
     return;
   }
-  auto r = flock(fd, LOCK_SH | LOCK_NB);
-  if (r < 0) {
-    std::cerr << "ERROR: failed to obtain read lock: " << cacheFile_ << " ("
-              << errno << ": " << strerror(errno) << ")" << std::endl;
-    close(fd);
-    return;
-  }
-  std::stringstream ss;
-  const int BUFFER_SIZE = 1024;
-  char buffer[BUFFER_SIZE];
-  ssize_t readsize;
-  while ((readsize = read(fd, buffer, BUFFER_SIZE)) > 0) {
-    ss << std::string(buffer, readsize);
+  if (cache_.map(fd) == false) {
+    std::cerr << "ERROR: failed to load cache: " << cacheFile_ << std::endl;
+  } else {
+    replaceCache_ = false;
   }
+  cacheGeneration_ = cache_.generation();
   close(fd);
 
-  try {
-    cache_ = YAML::Load(ss.str());
-  } catch (...) {
-    std::cerr << "ERROR: failed to load cache: " << cacheFile_ << std::endl;
-  }
   if (verbose_ > 2) {
     std::cerr << "DEBUG: isCacheLoaded(): " << isCacheLoaded() << std::endl;
   }
 }
 
+bool WebPowerSwitchManager::importYamlCache() {
+  struct stat statYamlFile;
+  if (stat(yamlCacheFile_.c_str(), &statYamlFile) != 0) {
+    return false;
+  }
+  try {
+    // it has no times of its own; the entries are as old as the file
+    cache_.importYaml(YAML::LoadFile(yamlCacheFile_), statYamlFile.st_mtime);
+  } catch (...) {
+    std::cerr << "ERROR: failed to load cache: " << yamlCacheFile_ << std::endl;
+    cache_.clear();
+    return false;
+  }
+  return isCacheLoaded();
+}
+
 void WebPowerSwitchManager::writeCacheStart() {
   if (enableCache_ == false) {
     return;
@@ -247,157 +677,178 @@ void WebPowerSwitchManager::writeCacheStart() {
   if (validateCacheFile() == false) {
     return;
   }
-  fdWrite_ = open(cacheFile_.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0777);
-  if (fdWrite_ < 0) {
-    std::cerr << "ERROR: failed to open for writing cache file: " << cacheFile_
-              << " (" << errno << ": " << strerror(errno) << ")" << std::endl;
-    return;
-  }
-  auto r = flock(fdWrite_, LOCK_EX | LOCK_NB);
-  if (r < 0) {
-    std::cerr << "ERROR: failed to obtain write lock: " << cacheFile_ << " ("
-              << errno << ": " << strerror(errno) << ")" << std::endl;
-    close(fdWrite_);
-    return;
-  }
+  // Nothing is held while switches are found; readers keep using the
+  // published file until writeCacheFinish replaces it.
+  writingCache_ = true;
 }
 
 void WebPowerSwitchManager::writeCacheFinish() {
-  if (fdWrite_ < 0) {
+  if (writingCache_ == false) {
     return;
   }
-  if (isCacheLoaded() == false) {
-    close(fdWrite_);
-    fdWrite_ = -1;
+  writingCache_ = false;
+  // A reset that found nothing still replaces what was there.
+  if (isCacheLoaded() == false && replaceCache_ == false) {
     return;
   }
 
-  std::stringstream ss;
-  ss << cache_;
-  auto output = ss.str();
-  if (write(fdWrite_, output.c_str(), output.length()) != static_cast<ssize_t>(output.length())) {
-    std::cerr << "failed to write cache: " << cacheFile_ << std::endl;
-  }
-  close(fdWrite_);
-  fdWrite_ = -1;
-}
-
-void WebPowerSwitchManager::findSwitches() {
-  if (findSwitches_ == false) {
+  // Writers take turns for the publish only.
+  auto lockFd = open(cacheLockFile_.c_str(), O_CREAT | O_RDWR, 0666);
+  if (lockFd < 0 || flock(lockFd, LOCK_EX) < 0) {
+    std::cerr << "ERROR: failed to obtain write lock: " << cacheLockFile_ << " ("
+              << errno << ": " << strerror(errno) << ")" << std::endl;
+    if (lockFd >= 0) {
+      close(lockFd);
+    }
     return;
   }
 
-  auto interface = getDefaultInterface();
-  std::string ipAddress;
-  std::string subNetMask;
-  getIpAddressAndSubnetMask(interface, ipAddress, subNetMask);
-
-  struct in_addr ipaddress;
-  struct in_addr subnetmask;
-  inet_pton(AF_INET, ipAddress.c_str(), &ipaddress);
-  inet_pton(AF_INET, subNetMask.c_str(), &subnetmask);
-
-  unsigned long firstIp = ntohl(ipaddress.s_addr & subnetmask.s_addr);
-  unsigned long lastIp = ntohl(ipaddress.s_addr | ~(subnetmask.s_addr));
-  std::vector<std::unique_ptr<WebPowerSwitch>> switches;
-  CURLM* multi_handle = curl_multi_init();
-  for (auto ip = firstIp; ip <= lastIp; ip++) {
-    struct in_addr testIp = { htonl(ip) };
-    if (verbose_ > 1) {
-      std::cout << "ip: " << ip << " - " << htonl(ip) << " - " << inet_ntoa(testIp) << std::endl;
-    }
-
-    for (auto up : vUsernamePassword_) {
-      std::unique_ptr<WebPowerSwitch> wps(new WebPowerSwitch(inet_ntoa(testIp)));
-      wps->verbose(verbose_);
-      wps->suppressDetectionErrors();
-      CURL* request = wps->startLogin(up.username, up.password);
-      if (request == nullptr) {
-        continue;
+  // Another process published since this one loaded: build on its file;
+  // unless this one replaces it, which still gets a newer generation.
+  auto fd = open(cacheFile_.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    auto published = SwitchCache::generation(fd);
+    if (replaceCache_) {
+      cacheGeneration_ = std::max(cacheGeneration_, published);
+    } else if (published > cacheGeneration_ && cache_.map(fd)) {
+      if (verbose_ > 2) {
+        std::cerr << "DEBUG: merging into cache generation: " << published << std::endl;
       }
-      curl_multi_add_handle(multi_handle, request);
-      switches.push_back(std::move(wps));
+      cacheGeneration_ = published;
     }
+    close(fd);
   }
 
-  // wait for requests to finish
-  int still_running = 1;
-  CURLMsg* msg;
-  int msgs_left;
-  while (still_running) {
-    CURLMcode mc = curl_multi_perform(multi_handle, &still_running);
-    if (still_running) {
-      mc = curl_multi_poll(multi_handle, nullptr, 0, 1000, nullptr);
-    }
-    if (mc) {
-      std::cout << "=== mc: " << mc << std::endl;
-      break;
+  // Written aside and renamed over the old file, so that readers (and
+  // their mappings) only ever see a whole file, even after a crash.
+  auto tmpFile = absl::StrCat(cacheFile_, ".", getpid());
+  fd = open(tmpFile.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0777);
+  bool written = fd >= 0 && cache_.write(fd, cacheGeneration_ + 1) && fsync(fd) == 0;
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (written == false) {
+    std::cerr << "failed to write cache: " << tmpFile << std::endl;
+    unlink(tmpFile.c_str());
+  } else if (rename(tmpFile.c_str(), cacheFile_.c_str()) != 0) {
+    std::cerr << "failed to replace cache: " << cacheFile_ << " ("
+              << errno << ": " << strerror(errno) << ")" << std::endl;
+    unlink(tmpFile.c_str());
+  } else {
+    cacheGeneration_++;
+    replaceCache_ = false;
+  }
+  close(lockFd);
+}
+
+void WebPowerSwitchManager::noteVerified(absl::string_view controller, time_t verified) {
+  if (verified <= time(nullptr) - cacheTimeout_) {
+    if (verbose_ > 2) {
+      std::cerr << "DEBUG: cache entry is too old: " << controller << std::endl;
     }
-    while ((msg = curl_multi_info_read(multi_handle, &msgs_left))) {
-      if (msg->msg == CURLMSG_DONE) {
-        for (auto& wps : switches) {
-          if (msg->easy_handle == wps->handle()) {
-            if (verbose_ > 2) {
-              std::cout << "done: " << wps->host() << std::endl;
-            }
-            curl_multi_remove_handle(multi_handle, wps->handle());
-            if (msg->data.result == CURLE_OK) {
-              CURL* request = wps->next();
-              if (request != nullptr) {
-                curl_multi_add_handle(multi_handle, request);
-              } else {
-                // request == nullptr: must be done here
-              }
-              break;
-            } else {
-              // not CURLE_OK
-              wps->logout();
-            }
-          }
-        }
-      }
+    staleControllers_.insert(std::string(controller));
+  }
+}
+
+void WebPowerSwitchManager::revalidateCache(ConnectionPool* pool) {
+  auto start = std::chrono::steady_clock::now();
+  std::unordered_set<std::string> expectedNames;
+  SwitchDiscovery discovery(vUsernamePassword_, maxProbes_, pool);
+  discovery.verbose(verbose_);
+  for (const auto& name : staleControllers_) {
+    absl::string_view host;
+    if (cache_.findController(name, host)) {
+      expectedNames.insert(name);
+      discovery.addHost(host);
     }
-    // If there are still handles present, then continue checking for progress
-    // maybe could be replaced with setting still_running above where handle is added.
-    if (!still_running) {
-      for (auto& wps : switches) {
-        if (wps->handle() != nullptr) {
-          still_running = 1;
-          break;
-        }
-      }
+  }
+  std::unordered_set<std::string> confirmedHosts;
+  discovery.run([this, &expectedNames, &confirmedHosts](std::unique_ptr<WebPowerSwitch>&& wps) {
+    if (wps->isLoggedIn()) {
+      expectedNames.erase(std::string(wps->name()));
+      confirmedHosts.insert(std::string(wps->host()));
     }
+    addSwitchToCache(std::move(wps));
+  });
+
+  if (verbose_) {
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "revalidate: " << confirmedHosts.size() << " hosts confirmed, "
+              << expectedNames.size() << " missing, time: " << elapsed.count() << "s" << std::endl;
   }
 
-  // Let them all finish completely.
-  // (Althouygh I'm not sure this is necessary anymore.)
-  while ((msg = curl_multi_info_read(multi_handle, &msgs_left))) {
-    if (msg->msg == CURLMSG_DONE) {
-      for (auto& wps : switches) {
-        if (msg->easy_handle == wps->handle()) {
-          if (verbose_ > 2) {
-            std::cout << "done: " << wps->host() << std::endl;
-          }
-          break;
-        }
-      }
-    }
+  // Only sweep when a known controller did not answer at its cached host.
+  if (expectedNames.empty()) {
+    return;
+  }
+  auto lockFd = lockDiscovery();
+  // Another process may have found them meanwhile (this one may have
+  // waited for it, or given up waiting).
+  if (loadNewerCache()) {
+    auto oldest = time(nullptr) - cacheTimeout_;
+    std::erase_if(expectedNames, [this, oldest](const std::string& name) {
+      absl::string_view host;
+      time_t verified;
+      return cache_.findController(name, host, &verified) && verified > oldest;
+    });
   }
+  if (!expectedNames.empty()) {
+    findSwitches(pool, confirmedHosts);
+  }
+  if (lockFd >= 0) {
+    close(lockFd);
+  }
+}
 
-  curl_multi_cleanup(multi_handle);
-  multi_handle = nullptr;
+void WebPowerSwitchManager::findSwitches(ConnectionPool* pool,
+                                         const std::unordered_set<std::string>& skipHosts) {
+  if (findSwitches_ == false) {
+    return;
+  }
 
-  if (verbose_) {
-    std::cout << "switches" << std::endl;
+  // Without explicit subnets, search the default route's interface.
+  std::vector<std::string> subnets = subnets_;
+  if (subnets.empty()) {
+    subnets.push_back(getDefaultInterface());
   }
 
-  // parse the successes
-  for (auto & wps : switches) {
+  auto sweepStart = std::chrono::steady_clock::now();
+  SwitchDiscovery discovery(vUsernamePassword_, maxProbes_, pool);
+  discovery.verbose(verbose_);
+  for (const auto& subnet : subnets) {
+    unsigned long firstIp;
+    unsigned long lastIp;
+    if (getSubnetRange(subnet, firstIp, lastIp) == false) {
+      std::cerr << "ERROR: unable to determine address range of: " << subnet << std::endl;
+      continue;
+    }
+    discovery.addRange(subnet, firstIp, lastIp);
+  }
+  for (const auto& host : skipHosts) {
+    discovery.excludeHost(host);
+  }
+  // Finished probes are handed over right away (kept only if they logged in),
+  // so memory stays proportional to maxProbes_ rather than to the subnet size.
+  discovery.run([this](std::unique_ptr<WebPowerSwitch>&& wps) {
     addSwitchToCache(std::move(wps));
+  });
+
+  if (verbose_) {
+    std::chrono::duration<double> sweepTime = std::chrono::steady_clock::now() - sweepStart;
+    struct rusage usage = {};
+    getrusage(RUSAGE_SELF, &usage);
+    std::cout << "sweep: " << discovery.probesStarted() << " probes, peak in flight: "
+              << discovery.peakInFlight() << ", time: " << sweepTime.count()
+              << "s, peak rss: " << usage.ru_maxrss << "KB" << std::endl;
+    for (const auto& stats : discovery.stats()) {
+      std::cout << "  " << stats.label << ": " << stats.addresses << " addresses, "
+                << stats.accepted << " accepted, " << stats.probes << " probes, "
+                << stats.found << " found, time: " << stats.seconds << "s" << std::endl;
+    }
   }
 }
 
-absl::string_view WebPowerSwitchManager::getDefaultInterface() {
+std::string WebPowerSwitchManager::getDefaultInterface() {
   static const char* ROUTE_FILENAME = "/proc/net/route";
   std::fstream routes(ROUTE_FILENAME, std::ios::in);
   const size_t BUFSIZE = 1024;
@@ -412,6 +863,37 @@ absl::string_view WebPowerSwitchManager::getDefaultInterface() {
   return "";
 } 
 
+bool WebPowerSwitchManager::getSubnetRange(absl::string_view subnet, unsigned long& firstIp, unsigned long& lastIp) {
+  struct in_addr ipaddress;
+  struct in_addr subnetmask;
+  auto slash = subnet.find('/');
+  if (slash != absl::string_view::npos) {
+    // CIDR: a.b.c.d/nn
+    std::string address(subnet.substr(0, slash));
+    std::string prefix(subnet.substr(slash + 1));
+    char* end = nullptr;
+    auto bits = strtoul(prefix.c_str(), &end, 10);
+    if (prefix.empty() || *end != '\0' || bits > 32 ||
+        inet_pton(AF_INET, address.c_str(), &ipaddress) != 1) {
+      return false;
+    }
+    subnetmask.s_addr = htonl(bits == 0 ? 0 : 0xffffffffUL << (32 - bits));
+  } else {
+    // interface name
+    std::string ipAddress;
+    std::string subNetMask;
+    getIpAddressAndSubnetMask(subnet, ipAddress, subNetMask);
+    if (inet_pton(AF_INET, ipAddress.c_str(), &ipaddress) != 1 ||
+        inet_pton(AF_INET, subNetMask.c_str(), &subnetmask) != 1) {
+      return false;
+    }
+  }
+
+  firstIp = ntohl(ipaddress.s_addr & subnetmask.s_addr);
+  lastIp = ntohl(ipaddress.s_addr | ~(subnetmask.s_addr));
+  return true;
+}
+
 void WebPowerSwitchManager::getIpAddressAndSubnetMask(absl::string_view interface, std::string& ipAddress, std::string& subNetMask) {
   struct ifaddrs* ifap;
   if (getifaddrs(&ifap) != 0) {
@@ -442,42 +924,229 @@ void WebPowerSwitchManager::getIpAddressAndSubnetMask(absl::string_view interfac
 }
 
 WebPowerSwitch* WebPowerSwitchManager::connectSwitch(absl::string_view ip) {
-  auto wps = std::make_unique<WebPowerSwitch>(ip);
+  auto wps = std::make_unique<WebPowerSwitch>(ip, &pool_);
   wps->verbose(verbose_);
-  for (auto up : vUsernamePassword_) {
-    if (wps->login(up.username, up.password)) {
-      break;
+  if (resumeSession(wps.get())) {
+    if (verbose_ > 0) {
+      std::cout << "resumed session: " << ip << std::endl;
     }
-  }
-  if (wps->isLoggedIn() == false) {
+  } else if (wps->login(vUsernamePassword_) == false) {
     if (verbose_ > 0) {
       std::cerr << "ERROR: login failed switch ip: " << ip << std::endl;
     }
     return nullptr;
   }
+  return adoptSwitch(std::move(wps));
+}
+
+Task<WebPowerSwitch*> WebPowerSwitchManager::connectSwitchAsync(std::string ip) {
+  auto wps = std::make_unique<WebPowerSwitch>(ip, &pool_);
+  wps->verbose(verbose_);
+  auto cookies = savedSession(ip);
+  bool resumed = false;
+  if (!cookies.empty()) {
+    resumed = co_await wps->resumeAsync(loop_, cookies);
+  }
+  if (resumed) {
+    if (verbose_ > 0) {
+      std::cout << "resumed session: " << ip << std::endl;
+    }
+  } else if (co_await wps->loginAsync(loop_, vUsernamePassword_) == false) {
+    if (verbose_ > 0) {
+      std::cerr << "ERROR: login failed switch ip: " << ip << std::endl;
+    }
+    co_return nullptr;
+  }
+  // another task may have connected it meanwhile; that one stays
+  auto existing = mNameToSwitch_.find(wps->name());
+  if (existing != mNameToSwitch_.end()) {
+    co_return existing->second.get();
+  }
+  co_return adoptSwitch(std::move(wps));
+}
 
+WebPowerSwitch* WebPowerSwitchManager::adoptSwitch(std::unique_ptr<WebPowerSwitch>&& wps) {
   // Store the name, so the pointer can be sent back from the map.
   std::string name(wps->name());
+  if (deferPublish_) {
+    addSwitchToCache(std::move(wps));
+    adopted_.push_back(name);
+    return mNameToSwitch_.find(name)->second.get();
+  }
+  saveSession(wps.get());
   writeCacheStart();
   addSwitchToCache(std::move(wps));
   writeCacheFinish();
   return mNameToSwitch_.find(name)->second.get();
 }
 
+void WebPowerSwitchManager::publishAdopted() {
+  if (adopted_.empty()) {
+    return;
+  }
+  std::vector<WebPowerSwitch*> switches;
+  for (const auto& name : adopted_) {
+    auto found = mNameToSwitch_.find(name);
+    if (found != mNameToSwitch_.end()) {
+      switches.push_back(found->second.get());
+    }
+  }
+  adopted_.clear();
+  saveSessions(switches);
+  // Their outlets are in cache_ already.
+  writeCacheStart();
+  writeCacheFinish();
+}
+
 void WebPowerSwitchManager::addSwitchToCache(std::unique_ptr<WebPowerSwitch>&& wps) {
   if (wps->isLoggedIn()) {
     if (verbose_) {
       std::cout << "host: " << wps->host() << " name: " << wps->name() << std::endl;
     }
-    auto outletsCache = cache_[CACHE_KEY_OUTLETS];
-    for (auto outlet : wps->outlets()) {
-      if (verbose_ > 1) {
-        std::cout << "outlet: " << outlet << std::endl;
-      }
-      outletsCache[std::string(outlet.name())][CACHE_OUTLETS_KEY_CONTROLLER] = std::string(wps->name());
-      outletsCache[std::string(outlet.name())][CACHE_OUTLETS_KEY_ID] = outlet.id();
+    cacheOutlets(wps.get());
+    auto& entry = mNameToSwitch_[std::string(wps->name())];
+    if (entry != nullptr) {
+      unindexSwitch(entry.get());
+      recheck_.erase(entry.get());
+    }
+    entry.reset(wps.release());
+    indexSwitch(entry.get());
+  }
+}
+
+void WebPowerSwitchManager::cacheOutlets(WebPowerSwitch* wps) {
+  auto now = time(nullptr);
+  // Outlets renamed or gone from the switch are dropped from the cache.
+  std::vector<SwitchCache::OutletEntry> outlets;
+  for (auto outlet : wps->outlets()) {
+    if (verbose_ > 1) {
+      std::cout << "outlet: " << outlet << std::endl;
+    }
+    outlets.push_back({std::string(outlet.name()), outlet.id(), outlet.state(), now});
+  }
+  cache_.replaceOutlets(wps->name(), outlets);
+  cache_.addController(wps->name(), wps->host(), now);
+  staleControllers_.erase(std::string(wps->name()));
+}
+
+void WebPowerSwitchManager::indexSwitch(WebPowerSwitch* wps) {
+  hostToSwitch_[std::string(wps->host())] = wps;
+  for (const auto& outlet : wps->outlets()) {
+    outletToSwitch_[std::string(outlet.name())] = wps;
+  }
+}
+
+void WebPowerSwitchManager::unindexSwitch(WebPowerSwitch* wps) {
+  auto host = hostToSwitch_.find(wps->host());
+  if (host != hostToSwitch_.end() && host->second == wps) {
+    hostToSwitch_.erase(host);
+  }
+  for (const auto& outlet : wps->outlets()) {
+    auto found = outletToSwitch_.find(outlet.name());
+    if (found != outletToSwitch_.end() && found->second == wps) {
+      outletToSwitch_.erase(found);
+    }
+  }
+}
+
+bool WebPowerSwitchManager::resumeSession(WebPowerSwitch* wps) {
+  auto cookies = savedSession(wps->host());
+  return !cookies.empty() && wps->resume(cookies);
+}
+
+std::vector<std::string> WebPowerSwitchManager::savedSession(absl::string_view host) {
+  std::vector<std::string> cookies;
+  if (validateSessionDirectory() == false) {
+    return cookies;
+  }
+  YAML::Node sessions;
+  try {
+    sessions = YAML::LoadFile(sessionFile_);
+  } catch (...) {
+    return cookies;
+  }
+  auto session = sessions[std::string(host)];
+  if (!session || session[SESSION_KEY_EXPIRES].as<time_t>(0) <= time(nullptr)) {
+    if (verbose_ > 2) {
+      std::cerr << "DEBUG: no live session for: " << host << std::endl;
     }
-    cache_[CACHE_KEY_CONTROLLERBYNAME][std::string(wps->name())][CACHE_CONTROLLERBYNAME_KEY_HOST] = std::string(wps->host());
-    mNameToSwitch_[std::string(wps->name())].reset(wps.release());
+    return cookies;
+  }
+  for (auto cookie : session[SESSION_KEY_COOKIES]) {
+    cookies.push_back(cookie.as<std::string>());
+  }
+  return cookies;
+}
+
+void WebPowerSwitchManager::saveSession(WebPowerSwitch* wps) {
+  saveSessions({wps});
+}
+
+void WebPowerSwitchManager::saveSessions(const std::vector<WebPowerSwitch*>& switches) {
+  if (validateSessionDirectory() == false) {
+    return;
+  }
+  std::vector<std::pair<WebPowerSwitch*, std::vector<std::string>>> cookiesBySwitch;
+  for (auto wps : switches) {
+    auto cookies = wps->sessionCookies();
+    if (!cookies.empty()) {
+      cookiesBySwitch.emplace_back(wps, std::move(cookies));
+    }
+  }
+  if (cookiesBySwitch.empty()) {
+    return;
+  }
+
+  // Read, changed and replaced by one process at a time.
+  auto lockFd = open(sessionLockFile_.c_str(), O_CREAT | O_RDWR | O_NOFOLLOW | O_CLOEXEC, 0600);
+  if (lockFd < 0 || flock(lockFd, LOCK_EX) < 0) {
+    std::cerr << "ERROR: failed to obtain session lock: " << sessionLockFile_ << " ("
+              << errno << ": " << strerror(errno) << ")" << std::endl;
+    if (lockFd >= 0) {
+      close(lockFd);
+    }
+    return;
+  }
+  YAML::Node sessions;
+  try {
+    sessions = YAML::LoadFile(sessionFile_);
+  } catch (...) {
+  }
+  // drop whatever has expired while here
+  auto now = time(nullptr);
+  YAML::Node live;
+  for (auto session : sessions) {
+    if (session.second[SESSION_KEY_EXPIRES].as<time_t>(0) > now) {
+      live[session.first.as<std::string>()] = session.second;
+    }
+  }
+  for (const auto& [wps, cookies] : cookiesBySwitch) {
+    auto session = live[std::string(wps->host())];
+    session[SESSION_KEY_EXPIRES] = now + sessionTimeout_;
+    session[SESSION_KEY_COOKIES] = cookies;
+  }
+
+  // Written aside and renamed into place, like the cache.  A new file
+  // only: nothing planted at that name is followed or reused.
+  auto tmpFile = absl::StrCat(sessionFile_, ".", getpid());
+  unlink(tmpFile.c_str());
+  auto fd = open(tmpFile.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_NOFOLLOW | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    std::cerr << "ERROR: failed to open for writing session file: " << tmpFile
+              << " (" << errno << ": " << strerror(errno) << ")" << std::endl;
+    close(lockFd);
+    return;
+  }
+  std::stringstream ss;
+  ss << live;
+  auto output = ss.str();
+  bool written = fchmod(fd, 0600) == 0 &&
+      write(fd, output.c_str(), output.length()) == static_cast<ssize_t>(output.length()) &&
+      fsync(fd) == 0;
+  close(fd);
+  if (written == false || rename(tmpFile.c_str(), sessionFile_.c_str()) != 0) {
+    std::cerr << "failed to write session file: " << sessionFile_ << std::endl;
+    unlink(tmpFile.c_str());
   }
+  close(lockFd);
 }
@@ -1,9 +1,12 @@
 #ifndef __WEBPOWERSWITCHMANAGER_H__INCLUDED__
 #define __WEBPOWERSWITCHMANAGER_H__INCLUDED__
 
+#include <algorithm>
 #include <unordered_map>
+#include <unordered_set>
 #include <yaml-cpp/yaml.h>
 
+#include "switchcache.h"
 #include "webpowerswitch.h"
 
 
@@ -12,50 +15,137 @@ public:
   WebPowerSwitchManager()
   : WebPowerSwitchManager(true, true) {}
   WebPowerSwitchManager(bool enableCache, bool findSwitches);
-  ~WebPowerSwitchManager();
   bool addUsernamePassword(absl::string_view username, absl::string_view password);
+  // cidr (a.b.c.d/nn) or interface name; default is the default route's
+  bool addSubnet(absl::string_view subnet);
   bool load();
   void resetCache();
-  WebPowerSwitch* getSwitch(std::string name, bool allow_miss = false);
-  WebPowerSwitch* getSwitchByIp(std::string ip, bool allow_miss = false);
-  WebPowerSwitch* getSwitchByOutletName(std::string name);
-  Outlet* getOutletByName(std::string name);
-  void dumpSwitches(std::ostream& ostr);
+  WebPowerSwitch* getSwitch(absl::string_view name, bool allow_miss = false);
+  WebPowerSwitch* getSwitchByIp(absl::string_view ip, bool allow_miss = false);
+  WebPowerSwitch* getSwitchByOutletName(absl::string_view name);
+  Outlet* getOutletByName(absl::string_view name);
+  // With maxAge, switches whose cached outlets are at most that many
+  // seconds old are shown from the cache instead of logging in.
+  void dumpSwitches(std::ostream& ostr, time_t maxAge = 0);
+  // Shows a switch (by name or host) or an outlet from the cache; false
+  // if it is unknown there or older than maxAge seconds.
+  bool showCached(absl::string_view target, std::ostream& ostr, time_t maxAge);
+  // Outlet states changed by commands, for showCached.  Only states read
+  // back from the switch (verify()) are kept; outlets given one an
+  // optimistic command assumed are cached as OUTLET_STATE_UNKNOWN.
+  void recordOutletStates(WebPowerSwitch* wps);
+  // For a long running process, once per request: switches last read at
+  // least maxAge seconds ago are re-read when next used, and connected
+  // afresh if that fails (their session may have expired meanwhile).
+  void recheckSwitches(time_t maxAge = 0);
+
+  // Coroutines for loop(): logins and commands on different switches run
+  // concurrently there, from one thread.  One operation at a time per switch.
+  EventLoop& loop() {
+    return loop_;
+  }
+  Task<WebPowerSwitch*> getSwitchAsync(std::string name);
+  // Outlet states read from the switch now (a fresh login reads them too).
+  Task<bool> refreshSwitchAsync(std::string name);
+  Task<bool> setOutletAsync(std::string outletName, OutletState state);
+  // Stale entries looked up so far are checked by a detached process, so
+  // the caller does not wait for it.  Only ever done when called: a
+  // program typically calls it once, on its way out.
+  void revalidateInBackground();
+  // The cache is binary; YAML is its interchange format.
+  bool exportCache(std::ostream& ostr);
+  bool importCache(absl::string_view yamlFile);
   void verbose(int increment = 1) {
     verbose_ += increment;
   }
+  void maxProbes(size_t maxProbes) {
+    maxProbes_ = std::max<size_t>(maxProbes, 1);
+  }
 
 private:
   bool enableCache_ = true;
   bool resetCache_ = false;
   bool findSwitches_ = true;
-  std::unordered_map<std::string, std::unique_ptr<WebPowerSwitch>> mNameToSwitch_;
-  struct UsernamePassword {
-    std::string username;
-    std::string password;
-  };
+  // declared before the switches so it outlives them
+  ConnectionPool pool_;
+  StringMap<std::unique_ptr<WebPowerSwitch>> mNameToSwitch_;
+  // Connected switches by host and by outlet name; kept by addSwitchToCache.
+  StringMap<WebPowerSwitch*> hostToSwitch_;
+  StringMap<WebPowerSwitch*> outletToSwitch_;
+  // connected switches to re-read before they are used again
+  std::unordered_set<WebPowerSwitch*> recheck_;
+  // set while several switches connect at once: adoptSwitch leaves their
+  // names in adopted_ for publishAdopted() instead of writing each
+  bool deferPublish_ = false;
+  std::vector<std::string> adopted_;
+  // after the switches: transfers are taken off it before their handles go
+  EventLoop loop_;
   std::vector<UsernamePassword> vUsernamePassword_;
+  std::vector<std::string> subnets_;
   std::string cacheFile_ = {};
-  YAML::Node cache_;
-  static const char* CACHE_KEY_CONTROLLERBYNAME;
-  static const char* CACHE_CONTROLLERBYNAME_KEY_HOST;
-  static const char* CACHE_KEY_OUTLETS;
-  static const char* CACHE_OUTLETS_KEY_CONTROLLER;
-  static const char* CACHE_OUTLETS_KEY_ID;
+  std::string yamlCacheFile_ = {};
+  std::string cacheLockFile_ = {};
+  std::string discoveryLockFile_ = {};
+  // of the cache file last loaded or published by this process
+  uint64_t cacheGeneration_ = 0;
+  // after a reset or an import: the next publish replaces the file
+  // instead of merging into it
+  bool replaceCache_ = false;
+  bool writingCache_ = false;
+  // per user, private: sessions-<uid>/ in the cache directory
+  std::string sessionDirectory_ = {};
+  std::string sessionFile_ = {};
+  std::string sessionLockFile_ = {};
+  SwitchCache cache_;
+  std::unordered_set<std::string> staleControllers_;
+  // an entry older than this is still used, but revalidated in the background
   const time_t cacheTimeout_ = (60 * 60) * 24;
+  const time_t sessionTimeout_ = 60 * 15;
+  // longest wait for another process's discovery before running our own
+  const time_t discoveryWaitTimeout_ = 60 * 2;
+  static const char* SESSION_KEY_EXPIRES;
+  static const char* SESSION_KEY_COOKIES;
   int verbose_ { 0 };
-  int fdWrite_ = -1;
+  size_t maxProbes_ = 256;
 
   bool isCacheLoaded();
   bool validateCacheFile();
+  bool validateSessionDirectory();
   void loadCache();
+  bool importYamlCache();
   void writeCacheStart();
   void writeCacheFinish();
-  void findSwitches();
-  absl::string_view getDefaultInterface();
+  void noteVerified(absl::string_view controller, time_t verified);
+  void revalidateCache(ConnectionPool* pool);
+  void discover();
+  int lockDiscovery();
+  uint64_t publishedGeneration();
+  // Maps the published cache if it is newer than this process's; entries
+  // added here since stay on top.
+  bool loadNewerCache();
+  void findSwitches(ConnectionPool* pool, const std::unordered_set<std::string>& skipHosts = {});
+  std::string getDefaultInterface();
+  bool getSubnetRange(absl::string_view subnet, unsigned long& firstIp, unsigned long& lastIp);
   void getIpAddressAndSubnetMask(absl::string_view interface, std::string& ipAddress, std::string& subNetMask);
   WebPowerSwitch* connectSwitch(absl::string_view ip);
+  Task<WebPowerSwitch*> connectSwitchAsync(std::string ip);
+  WebPowerSwitch* adoptSwitch(std::unique_ptr<WebPowerSwitch>&& wps);
+  bool resumeSession(WebPowerSwitch* wps);
+  std::vector<std::string> savedSession(absl::string_view host);
+  void saveSession(WebPowerSwitch* wps);
+  // One rewrite of the session file for all of switches.
+  void saveSessions(const std::vector<WebPowerSwitch*>& switches);
+  // Cache and sessions of the switches adopted while deferPublish_ was set.
+  void publishAdopted();
   void addSwitchToCache(std::unique_ptr<WebPowerSwitch>&& wps);
+  void cacheOutlets(WebPowerSwitch* wps);
+  void forgetOutletStates(WebPowerSwitch* wps);
+  bool recheck(WebPowerSwitch* wps);
+  Task<bool> recheckAsync(WebPowerSwitch* wps);
+  void dropSwitch(WebPowerSwitch* wps);
+  bool dumpCachedOutlets(absl::string_view controller, std::ostream& ostr, time_t oldest);
+  void indexSwitch(WebPowerSwitch* wps);
+  void unindexSwitch(WebPowerSwitch* wps);
 };
 
 #endif  /*  __WEBPOWERSWITCHMANAGER_H__INCLUDED__  */
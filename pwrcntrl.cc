@@ -1,13 +1,28 @@
+#include <chrono>
 #include <cxxopts.hpp>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <thread>
 #include <unistd.h>
 
+#include "controlsocket.h"
 #include "webpowerswitchmanager.h"
 
 // must persist beyond life of method
 static std::vector<std::string> arguments;
 
+// outlet off (or on) time of a cycle
+static const auto CYCLE_DELAY = std::chrono::seconds(5);
+// The daemon re-reads a switch not read for this long before using it,
+// and looks for stale cache entries to revalidate this often.
+static const time_t RECHECK_AFTER = 60;
+static const auto REVALIDATE_EVERY = std::chrono::minutes(5);
+
+// Work put off by the daemon, rather than keep other clients waiting.
+using Later = std::function<void(std::chrono::seconds delay, std::function<void()> work)>;
+
 std::vector<char*> loadCommandLineArguments(int iArgc, char* szArgv[], std::string optionsFilename) {
   std::vector<char*> cla;
   for (int iArg = 0; iArg < iArgc; iArg++, szArgv++) {
@@ -35,6 +50,98 @@ std::vector<char*> loadCommandLineArguments(int iArgc, char* szArgv[], std::stri
   return cla;
 }
 
+// Output goes to out, so that the same command can be answered to a client.
+// Without later, a cycle waits for its second half.
+int runCommand(WebPowerSwitchManager* wpsm, const controlSocket::Request& request, std::ostream& out,
+               const Later& later = nullptr) {
+  const auto& target = request.target;
+  const auto& command = request.command;
+
+  // If 'all', then only implement show.
+  if (target == "all") {
+    wpsm->dumpSwitches(out, request.maxAge);
+    return 0;
+  }
+
+  if (request.maxAge > 0 && (command.empty() || strncasecmp(command.c_str(), "show", 4) == 0) &&
+      wpsm->showCached(target, out, request.maxAge)) {
+    return 0;
+  }
+
+  auto wps = wpsm->getSwitch(target, true);
+  if (wps != nullptr) {
+    wps->dumpOutlets(out);
+    return 0;
+  }
+
+  wps = wpsm->getSwitchByIp(target, true);
+  if (wps != nullptr) {
+    wps->dumpOutlets(out);
+    return 0;
+  }
+
+  wps = wpsm->getSwitchByOutletName(target);
+  if (wps == nullptr) {
+    out << "unknown outlet (or switch): " << target << std::endl;
+    return -1;
+  }
+
+  out << wps->name() << ": " << *(wps->getOutlet(target)) << std::endl;
+
+  // Commands trust the switch; --verify costs one page read at the end.
+  wps->optimistic();
+
+  if (command.empty()) {
+    return 0;
+  }
+
+  if (strncasecmp(command.c_str(), "on", 2) == 0) {
+    wps->on(target);
+  } else if (strncasecmp(command.c_str(), "off", 3) == 0) {
+    wps->off(target);
+  } else if (strncasecmp(command.c_str(), "cycle", 5) == 0) {
+    auto original = wps->getOutlet(target)->state();
+    wps->toggle(target);
+    out << wps->name() << ": " << *(wps->getOutlet(target)) << std::endl;
+    if (later) {
+      // Looked up again then: the switch may have been reconnected.
+      later(CYCLE_DELAY, [wpsm, target, original, verify = request.verify]() {
+        auto wps = wpsm->getSwitchByOutletName(target);
+        if (wps == nullptr) {
+          return;
+        }
+        wps->optimistic();
+        if (original == OUTLET_STATE_ON) {
+          wps->on(target);
+        } else {
+          wps->off(target);
+        }
+        if (verify) {
+          wps->verify();
+        }
+        wpsm->recordOutletStates(wps);
+      });
+      return 0;
+    }
+    std::this_thread::sleep_for(CYCLE_DELAY);
+    wps->toggle(target);
+  } else if (strncasecmp(command.c_str(), "toggle", 5) == 0) {
+    wps->toggle(target);
+  } else {
+    out << "ERROR: unrecognized command: " << command << std::endl;
+    return 0;
+  }
+  // Without --verify (or if it fails) the states are assumed, and the
+  // cache is told it no longer knows them.
+  if (request.verify) {
+    wps->verify();
+  }
+  wpsm->recordOutletStates(wps);
+  out << wps->name() << ": " << *(wps->getOutlet(target)) << std::endl;
+
+  return 0;
+}
+
 
 int main(int iArgc, char* szArgv[]) {
   cxxopts::Options options(szArgv[0], "pwrcntrl: control web power switches");
@@ -50,11 +157,19 @@ int main(int iArgc, char* szArgv[]) {
     .add_options()
       ("command", "show|on|off|toggle|cycle: show, turn on, turn off, toggle or cycle outlet.", cxxopts::value<std::string>())
       ("credentials", "provide pairs of username:password to use on switch(es).", cxxopts::value<std::vector<std::string>>())
+      ("daemon", "stay running, logged in, and take commands from other pwrcntrl runs over --socket.")
+      ("export-cache", "print the switch cache as YAML.")
       ("help", "show help")
+      ("import-cache", "<yaml_file>: replace the switch cache with one exported by --export-cache.", cxxopts::value<std::string>())
+      ("max-age", "<seconds>: show outlet states cached at most this long ago without contacting the switch.", cxxopts::value<time_t>())
       ("options", "<option_file>: read command line parameters from option_file.", cxxopts::value<std::string>()->default_value(optionsFilename))
+      ("probes", "<count>: maximum number of discovery probes in flight.", cxxopts::value<size_t>())
       ("r,reset", "even if switch locations are known, go find them again.")
+      ("socket", "<path>: socket of the daemon; when one is listening there, commands are passed on to it.", cxxopts::value<std::string>()->default_value(controlSocket::defaultPath()))
+      ("subnets", "<cidr|interface>,...: subnets to search for switches (default: the default route's).", cxxopts::value<std::vector<std::string>>())
       ("t,target", "'all'|<name_of_switch|name_of_outlet", cxxopts::value<std::string>())
       ("v,verbose", "increate verbosity of output")
+      ("verify", "after a command, re-read outlet states from the switch.")
     ;
 
   options.parse_positional({"target", "command"});
@@ -68,7 +183,8 @@ int main(int iArgc, char* szArgv[]) {
   std::string target;
   if (optionsResult.count("target")) {
     target = optionsResult["target"].as<std::string>();
-  } else {
+  } else if (optionsResult.count("export-cache") == 0 && optionsResult.count("import-cache") == 0 &&
+             optionsResult.count("daemon") == 0) {
     std::cout << options.help() << std::endl;
     return 0;
   }
@@ -84,6 +200,27 @@ int main(int iArgc, char* szArgv[]) {
     }
   }
 
+  controlSocket::Request request;
+  request.target = target;
+  if (optionsResult.count("command")) {
+    request.command = optionsResult["command"].as<std::string>();
+  }
+  if (optionsResult.count("max-age") != 0) {
+    request.maxAge = optionsResult["max-age"].as<time_t>();
+  }
+  request.verify = optionsResult.count("verify") != 0;
+
+  // A running daemon answers without a login; options that change the
+  // cache are only done here.
+  auto socketPath = optionsResult["socket"].as<std::string>();
+  if (!target.empty() && optionsResult.count("daemon") == 0 && optionsResult.count("reset") == 0 &&
+      optionsResult.count("export-cache") == 0 && optionsResult.count("import-cache") == 0) {
+    int status;
+    if (controlSocket::call(socketPath, request, std::cout, status)) {
+      return status;
+    }
+  }
+
   std::unique_ptr<WebPowerSwitchManager> wpsm(new WebPowerSwitchManager);
 
   // Add credentials
@@ -103,65 +240,80 @@ int main(int iArgc, char* szArgv[]) {
     }
   }
 
+  // Add subnets
+  if (optionsResult.count("subnets") != 0) {
+    for (const auto& subnet : optionsResult["subnets"].as<std::vector<std::string>>()) {
+      if (!wpsm->addSubnet(subnet)) {
+        std::cerr << "Invalid subnet (" << subnet << ")" << std::endl;
+        return -1;
+      }
+    }
+  }
+
   // Verbosity
   if (optionsResult.count("verbose") != 0) {
     wpsm->verbose(optionsResult.count("verbose"));
   }
 
-  if (optionsResult.count("reset") != 0) {
-    wpsm->resetCache();
-  }
-
-  // If 'all', then only implement show.
-  if (target == "all") {
-    wpsm->dumpSwitches(std::cout);
-    return 0;
+  if (optionsResult.count("probes") != 0) {
+    wpsm->maxProbes(optionsResult["probes"].as<size_t>());
   }
 
-  auto wps = wpsm->getSwitch(target, true);
-  if (wps != nullptr) {
-    wps->dumpOutlets(std::cout);
-    return 0;
+  if (optionsResult.count("reset") != 0) {
+    wpsm->resetCache();
   }
 
-  wps = wpsm->getSwitchByIp(target, true);
-  if (wps != nullptr) {
-    wps->dumpOutlets(std::cout);
-    return 0;
+  if (optionsResult.count("import-cache") != 0 &&
+      !wpsm->importCache(optionsResult["import-cache"].as<std::string>())) {
+    return -1;
   }
-
-  wps = wpsm->getSwitchByOutletName(target);
-  if (wps == nullptr) {
-    std::cout << "unknown outlet (or switch): " << target << std::endl;
+  if (optionsResult.count("export-cache") != 0 && !wpsm->exportCache(std::cout)) {
     return -1;
   }
 
-  std::cout << wps->name() << ": " << *(wps->getOutlet(target)) << std::endl;
-
-  std::string command;
-  if (optionsResult.count("command")) {
-    command = optionsResult["command"].as<std::string>();
-  } else {
-    // no command
-    return 0;
+  if (optionsResult.count("daemon") != 0) {
+    using Clock = std::chrono::steady_clock;
+    std::multimap<Clock::time_point, std::function<void()>> pending;
+    Later later = [&pending](std::chrono::seconds delay, std::function<void()> work) {
+      pending.emplace(Clock::now() + delay, std::move(work));
+    };
+    auto nextRevalidation = Clock::now() + REVALIDATE_EVERY;
+    auto served = controlSocket::serve(socketPath,
+        [&wpsm, &later](const controlSocket::Request& request, std::ostream& out) {
+          wpsm->recheckSwitches(RECHECK_AFTER);
+          return runCommand(wpsm.get(), request, out, later);
+        },
+        [&wpsm, &pending, &nextRevalidation]() {
+          while (!pending.empty() && pending.begin()->first <= Clock::now()) {
+            auto work = std::move(pending.begin()->second);
+            pending.erase(pending.begin());
+            wpsm->recheckSwitches(RECHECK_AFTER);
+            work();
+          }
+          if (Clock::now() >= nextRevalidation) {
+            wpsm->revalidateInBackground();
+            nextRevalidation = Clock::now() + REVALIDATE_EVERY;
+          }
+          auto next = nextRevalidation;
+          if (!pending.empty()) {
+            next = std::min(next, pending.begin()->first);
+          }
+          auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(next - Clock::now());
+          return static_cast<int>(std::max<long>(wait.count(), 0) + 1);
+        }, optionsResult.count("verbose"));
+    // Cycles cut short by a shutdown still turn their outlets back.
+    for (auto& [due, work] : pending) {
+      std::this_thread::sleep_until(due);
+      work();
+    }
+    return served ? 0 : -1;
   }
 
-  if (strncasecmp(command.c_str(), "on", 2) == 0) {
-    wps->on(target);
-  } else if (strncasecmp(command.c_str(), "off", 3) == 0) {
-    wps->off(target);
-  } else if (strncasecmp(command.c_str(), "cycle", 5) == 0) {
-    wps->toggle(target);
-    std::cout << wps->name() << ": " << *(wps->getOutlet(target)) << std::endl;
-    sleep(5);
-    wps->toggle(target);
-  } else if (strncasecmp(command.c_str(), "toggle", 5) == 0) {
-    wps->toggle(target);
-  } else {
-    std::cout << "ERROR: unrecognized command: " << command << std::endl;
+  if (target.empty()) {
     return 0;
   }
-  std::cout << wps->name() << ": " << *(wps->getOutlet(target)) << std::endl;
 
-  return 0;
+  auto status = runCommand(wpsm.get(), request, std::cout);
+  wpsm->revalidateInBackground();
+  return status;
 }
@@ -0,0 +1,83 @@
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "webpowerswitchmanager.h"
+
+// Publishing after a reset or an import replaces the cache file instead of
+// merging into it.  Works in a cache directory of its own (TMPDIR) and never
+// looks for switches.
+
+static int failures = 0;
+
+static void check(bool condition, const std::string& what) {
+  if (condition == false) {
+    std::cout << "FAILED: " << what << std::endl;
+    failures++;
+  }
+}
+
+static std::string writeYaml(const std::string& directory, const std::string& controller) {
+  auto path = directory + "/" + controller + ".yaml";
+  std::ofstream yaml(path);
+  yaml << "controller_by_name:\n"
+       << "  " << controller << ":\n"
+       << "    host: 192.0.2.1\n"
+       << "outlets:\n"
+       << "  " << controller << "-outlet:\n"
+       << "    controller: " << controller << "\n"
+       << "    id: 1\n";
+  return path;
+}
+
+static bool importCache(const std::string& path) {
+  WebPowerSwitchManager wpsm(true, false);
+  return wpsm.importCache(path);
+}
+
+static std::string exportCache() {
+  WebPowerSwitchManager wpsm(true, false);
+  std::ostringstream out;
+  wpsm.exportCache(out);
+  return out.str();
+}
+
+static void importReplaces(const std::string& directory) {
+  check(importCache(writeYaml(directory, "alpha")), "import alpha");
+  check(exportCache().find("alpha") != std::string::npos, "alpha imported");
+  check(importCache(writeYaml(directory, "bravo")), "import bravo");
+  auto exported = exportCache();
+  check(exported.find("bravo") != std::string::npos, "bravo imported");
+  check(exported.find("alpha") == std::string::npos, "alpha gone after importing bravo");
+}
+
+static void resetReplaces(const std::string& directory) {
+  check(importCache(writeYaml(directory, "charlie")), "import charlie");
+  {
+    WebPowerSwitchManager wpsm(true, false);
+    wpsm.resetCache();
+    wpsm.load();
+  }
+  check(exportCache().find("charlie") == std::string::npos, "charlie gone after reset");
+}
+
+int main() {
+  char directory[] = "/tmp/cachetestXXXXXX";
+  if (mkdtemp(directory) == nullptr) {
+    std::cerr << "ERROR: mkdtemp failed" << std::endl;
+    return 1;
+  }
+  setenv("TMPDIR", directory, 1);
+
+  importReplaces(directory);
+  resetReplaces(directory);
+
+  std::filesystem::remove_all(directory);
+  if (failures == 0) {
+    std::cout << "cache: all passed" << std::endl;
+  }
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,179 @@
+#include <arpa/inet.h>
+#include <atomic>
+#include <iostream>
+#include <netinet/in.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+#include <absl/strings/match.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+
+#include "md5Helper.h"
+#include "webpowerswitch.h"
+
+// Logging in with a wrong credential ahead of the right one, against a fake
+// switch on the loopback interface.  Like the real ones, it answers a bad
+// login with a login page carrying a fresh challenge (input "Challenge")
+// and only accepts a response to the latest challenge.
+
+static int failures = 0;
+
+static void check(bool condition, const std::string& what) {
+  if (condition == false) {
+    std::cout << "FAILED: " << what << std::endl;
+    failures++;
+  }
+}
+
+class FakeSwitch {
+public:
+  FakeSwitch() {
+    listener_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    if (bind(listener_, reinterpret_cast<sockaddr*>(&address), length) != 0
+        || listen(listener_, 8) != 0
+        || getsockname(listener_, reinterpret_cast<sockaddr*>(&address), &length) != 0) {
+      perror("fake switch");
+      return;
+    }
+    port_ = ntohs(address.sin_port);
+    thread_ = std::thread([this] { serve(); });
+  }
+  ~FakeSwitch() {
+    shutdown(listener_, SHUT_RDWR);
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+    close(listener_);
+  }
+  std::string host() const {
+    return absl::StrCat("127.0.0.1:", port_);
+  }
+  int logins() const {
+    return logins_;
+  }
+
+private:
+  int listener_ = -1;
+  int port_ = 0;
+  int challenges_ = 0;
+  std::atomic<int> logins_ = 0;
+  std::string challenge_;
+  std::thread thread_;
+
+  void serve() {
+    for (;;) {
+      int fd = accept(listener_, nullptr, nullptr);
+      if (fd < 0) {
+        return;
+      }
+      auto request = readRequest(fd);
+      auto reply = answer(request);
+      write(fd, reply.data(), reply.size());
+      close(fd);
+    }
+  }
+
+  static std::string readRequest(int fd) {
+    std::string request;
+    char buffer[4096];
+    size_t bodyStart = std::string::npos;
+    size_t contentLength = 0;
+    while (bodyStart == std::string::npos || request.size() < bodyStart + contentLength) {
+      auto count = read(fd, buffer, sizeof(buffer));
+      if (count <= 0) {
+        break;
+      }
+      request.append(buffer, count);
+      if (bodyStart == std::string::npos) {
+        auto end = request.find("\r\n\r\n");
+        if (end != std::string::npos) {
+          bodyStart = end + 4;
+          for (auto line : absl::StrSplit(absl::string_view(request).substr(0, end), "\r\n")) {
+            if (absl::StartsWithIgnoreCase(line, "Content-Length:")) {
+              contentLength = std::stoul(std::string(line.substr(15)));
+            }
+          }
+        }
+      }
+    }
+    return request;
+  }
+
+  std::string loginPage() {
+    challenge_ = md5Helper::toHex(md5Helper::digest(absl::StrCat(++challenges_)));
+    return absl::StrCat("<html><body>\n"
+                        "<form action=\"/login.tgi\" method=\"post\" name=\"login\">\n"
+                        "<input type=\"hidden\" name=\"Challenge\" value=\"", challenge_, "\">\n"
+                        "</form>\n"
+                        "</body></html>\n");
+  }
+
+  std::string answer(const std::string& request) {
+    if (absl::StartsWith(request, "GET / ")) {
+      return reply(200, loginPage());
+    }
+    if (absl::StartsWith(request, "POST /login.tgi ")) {
+      auto body = absl::string_view(request).substr(request.find("\r\n\r\n") + 4);
+      std::string username;
+      std::string password;
+      for (auto field : absl::StrSplit(body, '&')) {
+        std::pair<std::string, std::string> pair = absl::StrSplit(field, absl::MaxSplits('=', 1));
+        if (pair.first == "Username") {
+          username = pair.second;
+        } else if (pair.first == "Password") {
+          password = pair.second;
+        }
+      }
+      auto expected = md5Helper::toHex(md5Helper::digest(challenge_ + "admin" + "right" + challenge_));
+      if (username == "admin" && password == expected) {
+        logins_++;
+        return reply(200, "<html><body>logged in</body></html>\n");
+      }
+      return reply(403, loginPage());
+    }
+    if (absl::StartsWith(request, "GET /index.htm ")) {
+      return reply(200,
+                   "<html><body>\n"
+                   "<table><tr><th>Controller: Fake</th></tr></table>\n"
+                   "<table>\n"
+                   "<tr><td colspan=5>Individual Control</td></tr>\n"
+                   "<tr><td>#</td><td>Name</td><td>State</td><td>Action</td></tr>\n"
+                   "<tr><td>1</td><td>Outlet 1</td><td><b>ON</b></td><td></td></tr>\n"
+                   "</table>\n"
+                   "</body></html>\n");
+    }
+    return reply(404, "");
+  }
+
+  static std::string reply(int code, const std::string& body) {
+    return absl::StrCat("HTTP/1.1 ", code, code == 200 ? " OK" : " Error", "\r\n",
+                        "Content-Type: text/html\r\n",
+                        "Content-Length: ", body.size(), "\r\n",
+                        "Connection: close\r\n",
+                        "\r\n", body);
+  }
+};
+
+static void wrongThenRight() {
+  FakeSwitch fake;
+  WebPowerSwitch wps(fake.host());
+  check(wps.login({{"admin", "wrong"}, {"admin", "right"}}), "second credential logs in");
+  check(fake.logins() == 1, "one successful login");
+  check(wps.name() == "Fake", "outlet page read after login");
+}
+
+int main() {
+  wrongThenRight();
+  if (failures != 0) {
+    std::cout << failures << " check(s) failed" << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,103 @@
+#include <iostream>
+#include <string>
+
+#include <absl/strings/str_cat.h>
+
+#include "outletpageparser.h"
+
+// Outlet pages through the streaming parser, whole and a byte at a time,
+// and through the tidy fallback: entities and inline markup in cells.
+
+static int failures = 0;
+
+static void check(bool condition, const std::string& what) {
+  if (condition == false) {
+    std::cout << "FAILED: " << what << std::endl;
+    failures++;
+  }
+}
+
+static std::string page(absl::string_view controllerCell, absl::string_view outletRows) {
+  return absl::StrCat("<html><body>\n"
+                      "<table><tr><td>\n"
+                      "<table><tr>", controllerCell, "</tr>\n"
+                      "<tr><td>Uptime: 1 day</td></tr></table>\n"
+                      "<table>\n"
+                      "<tr><td colspan=5>Individual Control</td></tr>\n"
+                      "<tr><td><b>#</b></td><td><b>Name</b></td><td><b>State</b></td></tr>\n",
+                      outletRows,
+                      "</table>\n"
+                      "</td></tr></table>\n"
+                      "</body></html>\n");
+}
+
+// Every way of reading the page must agree with name and outlets.
+static void expect(const std::string& what, const std::string& html, const std::string& name,
+                   const std::vector<Outlet>& outlets) {
+  OutletPageParser parser;
+  auto compare = [&](const std::string& how) {
+    auto label = absl::StrCat(what, " (", how, ")");
+    check(parser.name() == name, absl::StrCat(label, ": name '", parser.name(), "'"));
+    check(parser.outlets().size() == outlets.size(), absl::StrCat(label, ": outlet count"));
+    for (size_t i = 0; i < outlets.size() && i < parser.outlets().size(); i++) {
+      const auto& got = parser.outlets()[i];
+      check(got.id() == outlets[i].id() && got.name() == outlets[i].name() &&
+            got.state() == outlets[i].state(),
+            absl::StrCat(label, ": outlet '", got.name(), "'"));
+    }
+  };
+
+  parser.feed(html);
+  check(parser.finish(), absl::StrCat(what, " (one chunk): finish"));
+  compare("one chunk");
+
+  parser.reset();
+  for (size_t i = 0; i < html.size(); i++) {
+    parser.feed(absl::string_view(html).substr(i, 1));
+  }
+  check(parser.finish(), absl::StrCat(what, " (byte at a time): finish"));
+  compare("byte at a time");
+
+  check(parser.parseWithTidy(html), absl::StrCat(what, " (tidy): parse"));
+  compare("tidy");
+}
+
+static void plain() {
+  expect("plain",
+         page("<th>Controller: Rack A</th>",
+              "<tr><td>1</td>\n<td>Outlet 1</td><td>\n<b><font color=green>ON</font></b></td>"
+              "<td><a href=outlet?1=OFF>Switch OFF</a></td></tr>\n"
+              "<tr><td>2</td>\n<td>Outlet 2</td><td>\n<b><font color=red>OFF</font></b></td>"
+              "<td><a href=outlet?2=ON>Switch ON</a></td></tr>\n"),
+         "Rack A",
+         {{1, "Outlet 1", OUTLET_STATE_ON}, {2, "Outlet 2", OUTLET_STATE_OFF}});
+}
+
+static void entities() {
+  expect("entities",
+         page("<th>Controller: Lab &amp; Test</th>",
+              "<tr><td>1</td><td>Web &amp; DB</td><td>ON</td></tr>\n"
+              "<tr><td>2</td><td>Bob&#39;s&nbsp;&nbsp;box</td><td>OFF</td></tr>\n"),
+         "Lab & Test",
+         {{1, "Web & DB", OUTLET_STATE_ON}, {2, "Bob's box", OUTLET_STATE_OFF}});
+}
+
+static void nestedMarkup() {
+  expect("nested markup",
+         page("<th>Controller: <b>Rack A</b></th>",
+              "<tr><td><b>1</b></td><td><font color=blue>Core</font> <i>switch</i></td>"
+              "<td><b>ON</b></td></tr>\n"),
+         "Rack A",
+         {{1, "Core switch", OUTLET_STATE_ON}});
+}
+
+int main() {
+  plain();
+  entities();
+  nestedMarkup();
+  if (failures != 0) {
+    std::cout << failures << " check(s) failed" << std::endl;
+    return 1;
+  }
+  return 0;
+}